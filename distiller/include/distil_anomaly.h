@@ -0,0 +1,93 @@
+#ifndef _DISTIL_ANOMALY_H_
+#define _DISTIL_ANOMALY_H_
+
+#include "ribs.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "distil_record.h"
+#include "distil_dict.h"
+
+/*
+ * streaming rate anomaly detector. records are counted per source
+ * (host|file) and class into a ring of DISTIL_ANOMALY_BUCKETS fixed width
+ * time buckets, so state is a fixed size block per source no matter how
+ * many records go through. as a bucket closes its count feeds an EWMA of
+ * mean and variance; a negative class count that many deviations above its
+ * mean raises an alert, which is cleared once the count settles back.
+ *
+ * every source keeps its own clock, the newest record timestamp it has
+ * seen, so sources logging local time or replayed from the start don't
+ * push each other's records out. a bucket stays open for
+ * DISTIL_ANOMALY_GRACE buckets past that clock for records arriving out of
+ * order. a quiet source's clock moves on with wall time since its last
+ * record (distil_anomaly_tick). records for buckets already closed are
+ * counted as late and reported, never scored.
+ */
+
+#define DISTIL_ANOMALY_BUCKETS 60
+#define DISTIL_ANOMALY_BUCKET_MS 1000
+#define DISTIL_ANOMALY_GRACE 3          /* buckets a bucket stays open past the source's clock */
+#define DISTIL_ANOMALY_WARMUP 30        /* buckets closed before a source can alert */
+#define DISTIL_ANOMALY_MIN_COUNT 5      /* fewer negatives in a bucket are never a spike */
+#define DISTIL_ANOMALY_THRESHOLD 4.0
+
+enum {
+    DISTIL_CLASS_NEG,                   /* FATAL, ERROR, WARN */
+    DISTIL_CLASS_POS,                   /* everything else */
+    DISTIL_CLASS_MAX
+};
+
+enum {
+    DISTIL_ANOMALY_SPIKE,
+    DISTIL_ANOMALY_CLEARED,
+    DISTIL_ANOMALY_LATE                 /* records that came in after their bucket closed */
+};
+
+struct distil_anomaly_series {
+    uint32_t counts[DISTIL_ANOMALY_BUCKETS];
+    uint32_t sum;                       /* over the ring */
+    double mean, var;                   /* EWMA of closed bucket counts */
+};
+
+struct distil_anomaly_source {
+    uint64_t head;                      /* oldest open bucket, everything before it is closed */
+    uint64_t newest;                    /* newest record timestamp, ms */
+    uint64_t seen_at;                   /* wall time of the last record, ms */
+    uint32_t warm;
+    uint32_t late;                      /* late records not reported yet */
+    bool alerting;
+    struct distil_anomaly_series series[DISTIL_CLASS_MAX];
+};
+
+struct distil_anomaly_event {
+    int kind;
+    uint64_t ts;                        /* start of the bucket, ms */
+    const char *source;                 /* host|file */
+    size_t source_len;
+    uint32_t count;                     /* negatives in the bucket, late records for DISTIL_ANOMALY_LATE */
+    double mean, sd, z;
+    uint32_t window_neg, window_total;  /* over the ring */
+};
+
+typedef void (*distil_anomaly_cb)(const struct distil_anomaly_event *ev, void *arg);
+
+struct distil_anomaly_detector {
+    struct distil_dict sources;
+    struct vmbuf state;                 /* struct distil_anomaly_source per source id */
+    struct vmbuf key;
+    double threshold;
+    double alpha;
+    size_t late;                        /* all late records so far */
+    distil_anomaly_cb cb;
+    void *arg;
+};
+
+int distil_anomaly_init(struct distil_anomaly_detector *det, double threshold, distil_anomaly_cb cb, void *arg);
+int distil_anomaly_add(struct distil_anomaly_detector *det, const struct distil_record *rec, uint64_t now);
+void distil_anomaly_tick(struct distil_anomaly_detector *det, uint64_t now);
+void distil_anomaly_flush(struct distil_anomaly_detector *det);
+void distil_anomaly_free(struct distil_anomaly_detector *det);
+
+#endif /* _DISTIL_ANOMALY_H_ */
@@ -0,0 +1,134 @@
+#ifndef _DISTIL_COLUMNAR_H_
+#define _DISTIL_COLUMNAR_H_
+
+#include "ribs.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <limits.h>
+
+#include "distil_record.h"
+#include "distil_dict.h"
+
+/*
+ * immutable, time-partitioned columnar segments of collected records.
+ *
+ *   <dir>/<yyyymmdd>/<seq>.col   records whose timestamp falls on that (UTC) day
+ *
+ * a segment is laid out as: header, column data per block, block table
+ * (zone maps + column extents), dictionaries. host, file, level and
+ * template are dictionary encoded as uint32 codes, timestamps are zigzag
+ * delta varints from the block's min, messages are offsets + bytes.
+ * segments are written to a hidden temp file and renamed into place.
+ */
+
+#define DISTIL_COLUMNAR_MAGIC 0x4c4f435a /* ZCOL */
+#define DISTIL_COLUMNAR_VERSION 1
+#define DISTIL_COLUMNAR_BLOCK_ROWS (64 * 1024)
+#define DISTIL_COLUMNAR_SEGMENT_BLOCKS 16
+#define DISTIL_COLUMNAR_OPEN_PARTITIONS 4   /* input is roughly time ordered, a few days open at once is enough */
+#define DISTIL_COLUMNAR_TEMPLATE_MAX 256
+
+enum {
+    DISTIL_COL_TS,
+    DISTIL_COL_HOST,
+    DISTIL_COL_FILE,
+    DISTIL_COL_LEVEL,
+    DISTIL_COL_TEMPLATE,
+    DISTIL_COL_MESSAGE,
+    DISTIL_COL_MAX
+};
+
+#define DISTIL_COL_MASK(col) (1u << (col))
+#define DISTIL_COL_IS_DICT(col) ((col) >= DISTIL_COL_HOST && (col) <= DISTIL_COL_TEMPLATE)
+
+struct distil_columnar_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t num_rows;
+    uint32_t num_blocks;
+    uint64_t min_ts;
+    uint64_t max_ts;
+    uint64_t block_table_ofs;
+    uint64_t dict_ofs[DISTIL_COL_MAX];   /* uint32 count, uint32 offsets[count + 1], bytes */
+};
+
+/* zone map and column extents of one block */
+struct distil_columnar_block {
+    uint32_t num_rows;
+    uint32_t pad;
+    uint64_t min_ts;
+    uint64_t max_ts;
+    uint32_t min_code[DISTIL_COL_MAX];
+    uint32_t max_code[DISTIL_COL_MAX];
+    uint64_t col_ofs[DISTIL_COL_MAX];
+    uint64_t col_len[DISTIL_COL_MAX];
+};
+
+/* segment being built for one partition */
+struct distil_columnar_part {
+    uint32_t partition;       /* yyyymmdd of the open segment, 0: none */
+    uint64_t last_used;
+    uint32_t seq;
+    int fd;
+    char tmp_name[PATH_MAX + 16]; /* <partition dir>/.<seq>.col */
+    uint64_t ofs;
+    uint32_t num_rows;
+
+    struct distil_dict dicts[DISTIL_COL_MAX];
+    struct vmbuf blocks;      /* struct distil_columnar_block per sealed block */
+    struct distil_columnar_block block;
+    struct vmbuf cols[DISTIL_COL_MAX];  /* current block. uint64 ts, uint32 codes, uint32 message offsets */
+    struct vmbuf msg_bytes;   /* current block messages */
+    struct vmbuf scratch;
+};
+
+struct distil_columnar_writer {
+    char *dir;
+    uint64_t clock;
+    struct distil_columnar_part parts[DISTIL_COLUMNAR_OPEN_PARTITIONS];
+};
+
+struct distil_columnar_segment {
+    const char *mem;
+    size_t size;
+    const struct distil_columnar_header *header;
+    const struct distil_columnar_block *blocks;
+};
+
+/* a decoded row, only the requested columns are filled in */
+struct distil_columnar_row {
+    uint64_t ts;
+    const char *val[DISTIL_COL_MAX];
+    size_t len[DISTIL_COL_MAX];
+};
+
+typedef void (*distil_columnar_row_cb)(const struct distil_columnar_row *row, void *arg);
+
+/* rows to scan: a time range, and optionally exact values of dictionary columns */
+struct distil_columnar_query {
+    uint64_t from, to;                    /* inclusive ms, to == 0: open ended */
+    const char *equals[DISTIL_COL_MAX];   /* host, file, level or template. NULL: any */
+};
+
+int distil_columnar_writer_init(struct distil_columnar_writer *cw, const char *dir);
+int distil_columnar_writer_add(struct distil_columnar_writer *cw, const struct distil_record *rec);
+int distil_columnar_writer_flush(struct distil_columnar_writer *cw);
+int distil_columnar_writer_close(struct distil_columnar_writer *cw);
+
+int distil_columnar_segment_open(struct distil_columnar_segment *seg, const char *path);
+void distil_columnar_segment_close(struct distil_columnar_segment *seg);
+const char *distil_columnar_dict_get(const struct distil_columnar_segment *seg, int col, uint32_t code, size_t *len);
+
+/*
+ * calls cb for every row matching query, decoding only the columns in mask.
+ * partitions, segments and blocks outside the time range are never touched.
+ * an equality is looked up in each segment's dictionary once: segments
+ * without the value are skipped, and so are blocks whose code range (zone
+ * map) doesn't cover its code. returns number of rows, -1 on error
+ */
+ssize_t distil_columnar_scan(const char *dir, const struct distil_columnar_query *query, uint32_t mask, distil_columnar_row_cb cb, void *arg);
+
+size_t distil_columnar_template(const char *message, size_t len, char *out, size_t out_size);
+
+#endif /* _DISTIL_COLUMNAR_H_ */
@@ -0,0 +1,49 @@
+#ifndef _DISTIL_DICT_H_
+#define _DISTIL_DICT_H_
+
+#include "ribs.h"
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * string interning: maps byte strings to dense ids in insertion order.
+ * open addressing over ids, strings kept back to back in one buffer.
+ */
+struct distil_dict {
+    struct vmbuf bytes;
+    struct vmbuf entries;     /* uint32 offset, uint32 length per id */
+    struct vmbuf slots;       /* 0: empty, id + 1 otherwise */
+    uint32_t num_entries;
+    uint32_t num_slots;
+};
+
+int distil_dict_init(struct distil_dict *dict);
+uint32_t distil_dict_intern(struct distil_dict *dict, const char *str, size_t len);
+void distil_dict_reset(struct distil_dict *dict);
+void distil_dict_free(struct distil_dict *dict);
+
+static inline const char *
+distil_dict_get (struct distil_dict *dict, uint32_t id, size_t *len) {
+    const uint32_t *e = (const uint32_t *)vmbuf_data(&dict->entries) + 2 * id;
+    *len = e[1];
+    return vmbuf_data(&dict->bytes) + e[0];
+}
+
+static inline uint32_t
+distil_hash (const char *str, size_t len) {
+    uint32_t h = 2166136261u;
+    for (; len > 0; --len, ++str)
+        h = (h ^ (uint8_t)*str) * 16777619u;
+    return h;
+}
+
+static inline int
+distil_cmp_bytes (const char *a, size_t alen, const char *b, size_t blen) {
+    int res = memcmp(a, b, alen < blen ? alen : blen);
+    if (0 != res)
+        return res;
+    return alen < blen ? -1 : alen > blen;
+}
+
+#endif /* _DISTIL_DICT_H_ */
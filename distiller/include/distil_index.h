@@ -0,0 +1,102 @@
+#ifndef _DISTIL_INDEX_H_
+#define _DISTIL_INDEX_H_
+
+#include "ribs.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "distil_record.h"
+#include "distil_dict.h"
+
+/*
+ * append-only inverted index over collected records. the index directory
+ * holds immutable segments, each made of:
+ *
+ *   <seq>.docs   raw records, back to back
+ *   <seq>.doff   struct distil_doc_entry per doc: offset into .docs, timestamp
+ *   <seq>.post   per term, ascending doc ids as delta + varint
+ *   <seq>.terms  header, term entries sorted by term, term bytes
+ *
+ * .terms is renamed into place last. a segment without it is incomplete
+ * and never read.
+ */
+
+#define DISTIL_INDEX_MAGIC 0x5a44584c /* LXDZ */
+#define DISTIL_INDEX_VERSION 1
+#define DISTIL_INDEX_SEGMENT_DOCS (256 * 1024)
+#define DISTIL_QUERY_MAX_TERMS 64
+
+struct distil_index_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t num_terms;
+    uint32_t num_docs;
+    uint64_t min_ts;
+    uint64_t max_ts;
+};
+
+struct distil_term_entry {
+    uint32_t term_ofs;        /* into the term bytes following the entries */
+    uint32_t term_len;
+    uint64_t post_ofs;
+    uint32_t post_len;
+    uint32_t df;
+};
+
+struct distil_doc_entry {
+    uint64_t ofs;
+    uint64_t ts;
+};
+
+struct distil_index_writer {
+    char *dir;
+    uint32_t seq;
+    uint32_t num_docs;
+    uint64_t min_ts, max_ts;
+    int docs_fd;
+    uint64_t docs_ofs;
+    struct vmbuf docs;        /* records not yet written to .docs */
+
+    struct vmbuf doffs;       /* distil_doc_entry per doc */
+    struct distil_dict terms;
+    struct vmbuf term_stats;  /* struct distil_index_term per term id */
+    struct vmbuf pairs;       /* term id, doc id */
+};
+
+struct distil_index_segment {
+    uint32_t seq;
+    const struct distil_index_header *header;
+    const struct distil_term_entry *entries;
+    const char *term_bytes;
+    size_t terms_size;
+    const uint8_t *post;
+    size_t post_size;
+    const struct distil_doc_entry *doffs;
+    size_t doff_size;
+    const char *docs;
+    size_t docs_size;
+};
+
+typedef void (*distil_index_match_cb)(const struct distil_index_segment *seg, uint32_t doc, void *arg);
+
+int distil_index_writer_init(struct distil_index_writer *iw, const char *dir);
+int distil_index_writer_add(struct distil_index_writer *iw, const struct distil_record *rec);
+int distil_index_writer_flush(struct distil_index_writer *iw);
+int distil_index_writer_close(struct distil_index_writer *iw);
+
+int distil_index_segment_open(struct distil_index_segment *seg, const char *dir, uint32_t seq);
+void distil_index_segment_close(struct distil_index_segment *seg);
+const struct distil_term_entry *distil_index_segment_lookup(const struct distil_index_segment *seg, const char *term, size_t len);
+const char *distil_index_segment_doc(const struct distil_index_segment *seg, uint32_t doc, size_t *len);
+
+/*
+ * expr: words are ANDed, OR separates alternatives, e.g. "disk watermark OR node4".
+ * words are split into [a-z0-9]+ terms. empty expr matches everything in range.
+ * from/to are inclusive ms, to == 0 is open ended. returns number of matches,
+ * -1 on error or if the query can't be run as written: words without any
+ * [a-z0-9] run, or more than DISTIL_QUERY_MAX_TERMS terms
+ */
+ssize_t distil_index_query(const char *dir, const char *expr, uint64_t from, uint64_t to, distil_index_match_cb cb, void *arg);
+
+#endif /* _DISTIL_INDEX_H_ */
@@ -3,6 +3,7 @@
 
 #include "ribs.h"
 #include <getopt.h>
+#include <stdbool.h>
 
 #include "logz_utils.h"
 #include "logz_struct_defs.h"
@@ -13,6 +14,15 @@ struct distiller_config {
     char *data_dir;
     struct server *nw_source;
     struct vmbuf tmp;
+    char *query;
+    char *export_columns;
+    uint64_t from, to;        /* query time range, ms */
+    char *host;               /* export: only rows with exactly these values */
+    char *source_file;
+    char *level;
+    bool watch;
+    double threshold;         /* z-score of a negative rate spike */
+    bool from_start;          /* watch: read what the sources already hold as well */
 };
 
 struct distiller_config ds_conf;
@@ -24,6 +34,16 @@ void usage(char *arg0) {
     printf("       %*c  [-f|--fl-source]  optional(file data-source)\n", (int)strlen(arg0), ' ');
     printf("       %*c  [-s|--nw-source]  optional(network data-source. A typical HTTP server URI data-endpoint)\n", (int)strlen(arg0), ' ');
     printf("       %*c  [-d|--data]  required(dump to this directory)\n", (int)strlen(arg0), ' ');
+    printf("       %*c  [-q|--query]  optional(search collected data instead of collecting. e.g. \"disk watermark OR node4\")\n", (int)strlen(arg0), ' ');
+    printf("       %*c  [-x|--export]  optional(print these columns of collected data as TSV instead of collecting. ts,host,file,level,template,message)\n", (int)strlen(arg0), ' ');
+    printf("       %*c  [-H|--host]  optional(export rows of this host only)\n", (int)strlen(arg0), ' ');
+    printf("       %*c  [-S|--source-file]  optional(export rows of this source file only)\n", (int)strlen(arg0), ' ');
+    printf("       %*c  [-L|--level]  optional(export rows of this level only, e.g. ERROR)\n", (int)strlen(arg0), ' ');
+    printf("       %*c  [-F|--from]  optional(query records at or after this time, ms since epoch)\n", (int)strlen(arg0), ' ');
+    printf("       %*c  [-T|--to]  optional(query records at or before this time, ms since epoch)\n", (int)strlen(arg0), ' ');
+    printf("       %*c  [-w|--watch]  optional(follow file data-sources, or the segments of a logzilla --target, and report negative rate spikes per host|file instead of collecting)\n", (int)strlen(arg0), ' ');
+    printf("       %*c  [-b|--from-start]  optional(watch mode: read file data-sources from the start, not only what is appended from now on)\n", (int)strlen(arg0), ' ');
+    printf("       %*c  [-Z|--threshold]  optional(z-score reported as a spike in watch mode. default 4)\n", (int)strlen(arg0), ' ');
     printf("       %*c  [--help] prints this help\n", (int)strlen(arg0), ' ');
     printf("\n");
 
@@ -36,18 +56,29 @@ init_distiller_config (int argc, char *argv[]) {
 
     memset(&ds_conf, 0, sizeof(ds_conf));
     vmbuf_init(&ds_conf.tmp, 4096);
+    ds_conf.nw_source = calloc(1, sizeof(struct server));
   
     static struct option longopts[] = {
         {"fl-source", 2, 0, 'f'},
         {"nw-source", 2, 0, 's'},
         {"data", 1, 0, 'd'},
+        {"query", 1, 0, 'q'},
+        {"export", 1, 0, 'x'},
+        {"host", 1, 0, 'H'},
+        {"source-file", 1, 0, 'S'},
+        {"level", 1, 0, 'L'},
+        {"from", 1, 0, 'F'},
+        {"to", 1, 0, 'T'},
+        {"watch", 0, 0, 'w'},
+        {"threshold", 1, 0, 'Z'},
+        {"from-start", 0, 0, 'b'},
         {"help", 0, 0, 1},
         {0, 0, 0, 0}
     };
 
     while (1) {
         int option_index = 0;
-        int c = getopt_long(argc, argv, "f:s:d", longopts, &option_index);
+        int c = getopt_long(argc, argv, "f:s:d:q:x:H:S:L:F:T:wZ:b", longopts, &option_index);
         if (c == -1)
             break;
         switch (c) {
@@ -57,6 +88,38 @@ init_distiller_config (int argc, char *argv[]) {
         case 'd':
             ds_conf.data_dir = strdup(optarg);
             break;
+        case 'q':
+            ds_conf.query = strdup(optarg);
+            break;
+        case 'x':
+            ds_conf.export_columns = strdup(optarg);
+            break;
+        case 'H':
+            ds_conf.host = strdup(optarg);
+            break;
+        case 'S':
+            ds_conf.source_file = strdup(optarg);
+            break;
+        case 'L':
+            ds_conf.level = strdup(optarg);
+            break;
+        case 'F':
+            ds_conf.from = strtoull(optarg, NULL, 10);
+            break;
+        case 'T':
+            ds_conf.to = strtoull(optarg, NULL, 10);
+            break;
+        case 'w':
+            ds_conf.watch = true;
+            break;
+        case 'Z':
+            ds_conf.threshold = strtod(optarg, NULL);
+            if (0 >= ds_conf.threshold)
+                usage(argv[0]);
+            break;
+        case 'b':
+            ds_conf.from_start = true;
+            break;
         case 's':
             vmbuf_reset(&ds_conf.tmp);
             char *uri = strdup(optarg);
@@ -0,0 +1,87 @@
+#ifndef _DISTIL_RECORD_H_
+#define _DISTIL_RECORD_H_
+
+#include "ribs.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <zlib.h>
+#include <sys/types.h>
+
+/*
+ * one collected log line: <node_name>|<source_file>|<message_text>, as
+ * shipped by logzilla. fields point into the reader's buffers and are only
+ * valid until the next distil_reader_next() call.
+ */
+struct distil_record {
+    uint64_t ts;              /* ms since epoch, from the message or ingest time */
+    const char *host;
+    size_t host_len;
+    const char *file;
+    size_t file_len;
+    const char *level;        /* INFO, WARN ... empty if unknown */
+    size_t level_len;
+    const char *message;
+    size_t message_len;
+    const char *raw;          /* whole record, host|file|message */
+    size_t raw_len;
+};
+
+/*
+ * line reader over plain or gzip'ed files: raw host|file|message lines
+ * or logzilla --target segments ({ "message": "..." } per line). logzilla
+ * ships a whole read chunk as one message; it is handed out a line at a
+ * time, every line with the chunk's host|file.
+ *
+ * a followed file is still being written: end of input only means nothing
+ * yet. it is read from its end unless asked for everything. once the path
+ * points at a new file (rotated) the old one is read to the end and the new
+ * one from its start; a file shrinking under the reader (truncated) is read
+ * again from its start. a path that doesn't exist is taken as a logzilla
+ * --target: its segments, <target>.<epoch>.<seq>[.gz] and the one still
+ * being written, are followed in seq order.
+ */
+struct distil_reader {
+    gzFile gz;
+    struct vmbuf buf;
+    uint64_t default_ts;      /* last record's timestamp, ingest time before the first */
+    bool eof;
+
+    bool follow;
+    bool draining;            /* follow: a newer file showed up, this one is being read to the end */
+    char *path;
+    int fd;                   /* the one gz reads from */
+    dev_t dev;
+    ino_t ino;
+    char *seg_dir, *seg_base; /* following a logzilla --target */
+    uint64_t seq;             /* segment being read */
+
+    /* lines of the current chunk not handed out yet, in buf */
+    const char *host, *file;
+    size_t host_len, file_len;
+    const char *rest, *rest_end;
+    struct vmbuf line;        /* host|file|line of those */
+};
+
+int distil_reader_open(struct distil_reader *reader, const char *filename);
+int distil_reader_follow(struct distil_reader *reader, const char *path, bool from_start);
+int distil_reader_next(struct distil_reader *reader, struct distil_record *rec);
+void distil_reader_close(struct distil_reader *reader);
+
+int distil_record_parse(char *line, size_t len, uint64_t default_ts, struct distil_record *rec);
+
+/* [a-z0-9]+ runs, same as tokenize() in scripts/src. returns start of the next token or NULL */
+static inline const char *
+distil_next_token (const char *p, const char *end, size_t *len) {
+    while (p < end && !((*p >= 'a' && *p <= 'z') || (*p >= '0' && *p <= '9')))
+        ++p;
+    if (p == end)
+        return NULL;
+    const char *s = p;
+    while (p < end && ((*p >= 'a' && *p <= 'z') || (*p >= '0' && *p <= '9')))
+        ++p;
+    *len = p - s;
+    return s;
+}
+
+#endif /* _DISTIL_RECORD_H_ */
@@ -0,0 +1,74 @@
+#ifndef _DISTIL_UTILS_H_
+#define _DISTIL_UTILS_H_
+
+#include "ribs.h"
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * helpers shared by the on-disk formats: the inverted index and the
+ * columnar segments.
+ */
+
+int distil_write_fully(int fd, const void *data, size_t size);
+int distil_cmp_u32(const void *a, const void *b);
+/* uint32 values of the names in dir that are a number followed by suffix, ascending. a missing dir is empty */
+int distil_list_numbered(const char *dir, const char *suffix, struct vmbuf *out);
+
+/* LEB128, 7 bits a byte. decode returns the byte past the value, NULL if it runs past end */
+static inline size_t
+distil_varint_encode (uint8_t *out, uint32_t v) {
+    size_t n = 0;
+    while (v >= 0x80) {
+        out[n++] = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    out[n++] = (uint8_t)v;
+    return n;
+}
+
+static inline const uint8_t *
+distil_varint_decode (const uint8_t *p, const uint8_t *end, uint32_t *v) {
+    uint32_t res = 0;
+    int shift = 0;
+    while (p < end && shift < 35) {
+        uint8_t b = *p++;
+        res |= (uint32_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            *v = res;
+            return p;
+        }
+        shift += 7;
+    }
+    return NULL;
+}
+
+static inline size_t
+distil_varint64_encode (uint8_t *out, uint64_t v) {
+    size_t n = 0;
+    while (v >= 0x80) {
+        out[n++] = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    out[n++] = (uint8_t)v;
+    return n;
+}
+
+static inline const uint8_t *
+distil_varint64_decode (const uint8_t *p, const uint8_t *end, uint64_t *v) {
+    uint64_t res = 0;
+    int shift = 0;
+    while (p < end && shift < 70) {
+        uint8_t b = *p++;
+        res |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            *v = res;
+            return p;
+        }
+        shift += 7;
+    }
+    return NULL;
+}
+
+#endif /* _DISTIL_UTILS_H_ */
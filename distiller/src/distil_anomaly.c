@@ -0,0 +1,201 @@
+#include "distil_anomaly.h"
+
+#include <string.h>
+#include <math.h>
+
+#define DISTIL_ANOMALY_MAX_CATCHUP (4 * DISTIL_ANOMALY_BUCKETS) /* idle buckets worth closing one by one */
+
+
+static inline struct distil_anomaly_source *
+source_get (struct distil_anomaly_detector *det, uint32_t id) {
+    return (struct distil_anomaly_source *)vmbuf_data(&det->state) + id;
+}
+
+static int
+classify (const struct distil_record *rec) {
+    if (0 == rec->level_len)
+        return DISTIL_CLASS_POS;
+    switch (rec->level[0]) {
+    case 'F': /* FATAL */
+    case 'E': /* ERROR */
+    case 'W': /* WARN */
+        return DISTIL_CLASS_NEG;
+    }
+    return DISTIL_CLASS_POS;
+}
+
+static inline uint64_t
+open_from (uint64_t ts) {
+    uint64_t bucket = ts / DISTIL_ANOMALY_BUCKET_MS;
+    return bucket > DISTIL_ANOMALY_GRACE ? bucket - DISTIL_ANOMALY_GRACE : 0;
+}
+
+static void
+report (struct distil_anomaly_detector *det, uint32_t id, struct distil_anomaly_source *src, int kind, uint32_t count, double sd, double z) {
+    struct distil_anomaly_event ev;
+    ev.kind = kind;
+    ev.ts = src->head * DISTIL_ANOMALY_BUCKET_MS;
+    ev.source = distil_dict_get(&det->sources, id, &ev.source_len);
+    ev.count = count;
+    ev.mean = src->series[DISTIL_CLASS_NEG].mean;
+    ev.sd = sd;
+    ev.z = z;
+    ev.window_neg = src->series[DISTIL_CLASS_NEG].sum;
+    ev.window_total = src->series[DISTIL_CLASS_NEG].sum + src->series[DISTIL_CLASS_POS].sum;
+    det->cb(&ev, det->arg);
+}
+
+/* scores the oldest open bucket against the baseline, then folds it in */
+static void
+source_close_bucket (struct distil_anomaly_detector *det, uint32_t id, struct distil_anomaly_source *src) {
+    uint32_t slot = src->head % DISTIL_ANOMALY_BUCKETS;
+    struct distil_anomaly_series *neg = &src->series[DISTIL_CLASS_NEG];
+    uint32_t x = neg->counts[slot];
+
+    // counts are poisson-ish: a flat baseline still has sqrt(mean) of noise
+    double sd = sqrt(neg->var);
+    if (sd < sqrt(neg->mean))
+        sd = sqrt(neg->mean);
+    if (sd < 1.0)
+        sd = 1.0;
+    double z = (x - neg->mean) / sd;
+
+    if (!src->alerting && DISTIL_ANOMALY_WARMUP <= src->warm && DISTIL_ANOMALY_MIN_COUNT <= x && det->threshold <= z) {
+        src->alerting = true;
+        report(det, id, src, DISTIL_ANOMALY_SPIKE, x, sd, z);
+    } else if (src->alerting && z < det->threshold / 2) {
+        src->alerting = false;
+        report(det, id, src, DISTIL_ANOMALY_CLEARED, x, sd, z);
+    }
+
+    // plain average until the window has filled once, EWMA after
+    double alpha = det->alpha;
+    if (alpha < 1.0 / (src->warm + 1))
+        alpha = 1.0 / (src->warm + 1);
+    int c;
+    for (c = 0; c < DISTIL_CLASS_MAX; ++c) {
+        struct distil_anomaly_series *s = &src->series[c];
+        double d = s->counts[slot] - s->mean;
+        s->mean += alpha * d;
+        s->var = (1 - alpha) * (s->var + alpha * d * d);
+    }
+    if (DISTIL_ANOMALY_WARMUP > src->warm)
+        ++src->warm;
+}
+
+/*
+ * closes buckets up to (not including) to. open buckets are always
+ * [head, head + DISTIL_ANOMALY_GRACE]; the slot of the one entering that
+ * range is recycled as head moves
+ */
+static void
+source_advance (struct distil_anomaly_detector *det, uint32_t id, uint64_t to) {
+    struct distil_anomaly_source *src = source_get(det, id);
+    uint32_t closed = 0;
+    int c;
+    while (src->head < to) {
+        if (DISTIL_ANOMALY_MAX_CATCHUP == closed++) {
+            // idle for long: the baseline has decayed, the rest would only be empty buckets
+            for (c = 0; c < DISTIL_CLASS_MAX; ++c) {
+                memset(src->series[c].counts, 0, sizeof(src->series[c].counts));
+                src->series[c].sum = 0;
+            }
+            src->head = to;
+            break;
+        }
+        source_close_bucket(det, id, src);
+        ++src->head;
+        uint32_t slot = (src->head + DISTIL_ANOMALY_GRACE) % DISTIL_ANOMALY_BUCKETS;
+        for (c = 0; c < DISTIL_CLASS_MAX; ++c) {
+            struct distil_anomaly_series *s = &src->series[c];
+            s->sum -= s->counts[slot];
+            s->counts[slot] = 0;
+        }
+    }
+    if (0 < src->late) {
+        report(det, id, src, DISTIL_ANOMALY_LATE, src->late, 0, 0);
+        src->late = 0;
+    }
+}
+
+int
+distil_anomaly_init (struct distil_anomaly_detector *det, double threshold, distil_anomaly_cb cb, void *arg) {
+    memset(det, 0, sizeof(*det));
+    if (0 > distil_dict_init(&det->sources))
+        return -1;
+    vmbuf_init(&det->state, 64 * sizeof(struct distil_anomaly_source));
+    vmbuf_init(&det->key, 1024);
+    det->threshold = threshold;
+    det->alpha = 2.0 / (DISTIL_ANOMALY_BUCKETS + 1);
+    det->cb = cb;
+    det->arg = arg;
+    return 0;
+}
+
+/* now: wall time, ms. quiet sources' clocks move on by the time since their last record */
+void
+distil_anomaly_tick (struct distil_anomaly_detector *det, uint64_t now) {
+    uint32_t id;
+    for (id = 0; id < det->sources.num_entries; ++id) {
+        struct distil_anomaly_source *src = source_get(det, id);
+        uint64_t to = open_from(src->newest + (now > src->seen_at ? now - src->seen_at : 0));
+        if (to > src->head || 0 < src->late)
+            source_advance(det, id, to);
+    }
+}
+
+/* closes every open bucket, e.g. before stopping: what's counted so far gets scored */
+void
+distil_anomaly_flush (struct distil_anomaly_detector *det) {
+    uint32_t id;
+    for (id = 0; id < det->sources.num_entries; ++id) {
+        struct distil_anomaly_source *src = source_get(det, id);
+        source_advance(det, id, src->newest / DISTIL_ANOMALY_BUCKET_MS + 1);
+    }
+}
+
+int
+distil_anomaly_add (struct distil_anomaly_detector *det, const struct distil_record *rec, uint64_t now) {
+    vmbuf_reset(&det->key);
+    vmbuf_memcpy(&det->key, rec->host, rec->host_len);
+    vmbuf_chrcpy(&det->key, '|');
+    vmbuf_memcpy(&det->key, rec->file, rec->file_len);
+    uint32_t num_sources = det->sources.num_entries;
+    uint32_t id = distil_dict_intern(&det->sources, vmbuf_data(&det->key), vmbuf_wlocpos(&det->key));
+    if (id == num_sources) {
+        // new source, its clock starts at its first record
+        vmbuf_resize_if_less(&det->state, sizeof(struct distil_anomaly_source));
+        memset(vmbuf_wloc(&det->state), 0, sizeof(struct distil_anomaly_source));
+        vmbuf_wseek(&det->state, sizeof(struct distil_anomaly_source));
+        struct distil_anomaly_source *src = source_get(det, id);
+        src->head = open_from(rec->ts);
+        src->newest = rec->ts;
+    }
+
+    struct distil_anomaly_source *src = source_get(det, id);
+    src->seen_at = now;
+    if (rec->ts > src->newest) {
+        src->newest = rec->ts;
+        if (open_from(rec->ts) > src->head)
+            source_advance(det, id, open_from(rec->ts));
+    }
+
+    uint64_t bucket = rec->ts / DISTIL_ANOMALY_BUCKET_MS;
+    if (bucket < src->head) {
+        // scored already, can't take it back
+        ++src->late;
+        ++det->late;
+        return 0;
+    }
+    struct distil_anomaly_series *s = &src->series[classify(rec)];
+    ++s->counts[bucket % DISTIL_ANOMALY_BUCKETS];
+    ++s->sum;
+    return 0;
+}
+
+void
+distil_anomaly_free (struct distil_anomaly_detector *det) {
+    distil_dict_free(&det->sources);
+    vmbuf_free(&det->state);
+    vmbuf_free(&det->key);
+}
@@ -0,0 +1,559 @@
+#include "distil_columnar.h"
+#include "distil_utils.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <ctype.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define DAY_MS (24ULL * 3600 * 1000)
+
+
+static uint32_t
+partition_of (uint64_t ts) {
+    time_t t = ts / 1000;
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    return (tm.tm_year + 1900) * 10000 + (tm.tm_mon + 1) * 100 + tm.tm_mday;
+}
+
+static uint64_t
+partition_start (uint32_t partition) {
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    tm.tm_year = partition / 10000 - 1900;
+    tm.tm_mon = (partition / 100) % 100 - 1;
+    tm.tm_mday = partition % 100;
+    return (uint64_t)timegm(&tm) * 1000;
+}
+
+/* first line of the message with every token that carries a digit folded into '#' */
+size_t
+distil_columnar_template (const char *message, size_t len, char *out, size_t out_size) {
+    const char *p = message, *end = message + len;
+    size_t n = 0;
+    while (p < end && *p != '\n' && n < out_size) {
+        if (!isalnum((unsigned char)*p)) {
+            out[n++] = *p++;
+            continue;
+        }
+        const char *s = p;
+        bool digit = false;
+        for (; p < end && isalnum((unsigned char)*p); ++p)
+            digit |= isdigit((unsigned char)*p);
+        if (digit) {
+            out[n++] = '#';
+        } else {
+            size_t l = p - s;
+            if (l > out_size - n)
+                l = out_size - n;
+            memcpy(out + n, s, l);
+            n += l;
+        }
+    }
+    return n;
+}
+
+
+/*
+ * writer
+ */
+
+static void
+block_reset (struct distil_columnar_part *part) {
+    memset(&part->block, 0, sizeof(part->block));
+    part->block.min_ts = UINT64_MAX;
+    int col;
+    for (col = 0; col < DISTIL_COL_MAX; ++col) {
+        vmbuf_reset(&part->cols[col]);
+        part->block.min_code[col] = UINT32_MAX;
+    }
+    vmbuf_reset(&part->msg_bytes);
+    uint32_t zero = 0;
+    vmbuf_memcpy(&part->cols[DISTIL_COL_MESSAGE], &zero, sizeof(zero));
+}
+
+static int
+part_emit (struct distil_columnar_part *part, int col, const void *data, size_t size) {
+    if (0 > distil_write_fully(part->fd, data, size))
+        return LOGGER_PERROR("cannot write %s", part->tmp_name), -1;
+    if (0 <= col) {
+        part->block.col_ofs[col] = part->ofs;
+        part->block.col_len[col] = size;
+    }
+    part->ofs += size;
+    return 0;
+}
+
+/* keeps mapped uint32/uint64 reads aligned */
+static int
+part_align (struct distil_columnar_part *part) {
+    static const char zeros[8];
+    size_t pad = (8 - (part->ofs & 7)) & 7;
+    return 0 < pad ? part_emit(part, -1, zeros, pad) : 0;
+}
+
+static int
+part_seal_block (struct distil_columnar_part *part) {
+    uint32_t rows = part->block.num_rows;
+    if (0 == rows)
+        return 0;
+
+    // timestamps: zigzag deltas, the first one against the block's min
+    const uint64_t *ts = (const uint64_t *)vmbuf_data(&part->cols[DISTIL_COL_TS]);
+    vmbuf_reset(&part->scratch);
+    vmbuf_resize_if_less(&part->scratch, rows * 10);
+    uint8_t *out = (uint8_t *)vmbuf_data(&part->scratch);
+    size_t n = 0;
+    uint64_t prev = part->block.min_ts;
+    uint32_t i;
+    for (i = 0; i < rows; ++i) {
+        int64_t d = (int64_t)(ts[i] - prev);
+        n += distil_varint64_encode(out + n, ((uint64_t)d << 1) ^ (uint64_t)(d >> 63));
+        prev = ts[i];
+    }
+    if (0 > part_emit(part, DISTIL_COL_TS, out, n))
+        return -1;
+
+    int col;
+    for (col = DISTIL_COL_HOST; col <= DISTIL_COL_TEMPLATE; ++col) {
+        if (0 > part_align(part) || 0 > part_emit(part, col, vmbuf_data(&part->cols[col]), vmbuf_wlocpos(&part->cols[col])))
+            return -1;
+    }
+
+    size_t offs_size = vmbuf_wlocpos(&part->cols[DISTIL_COL_MESSAGE]);
+    if (0 > part_align(part)
+        || 0 > part_emit(part, DISTIL_COL_MESSAGE, vmbuf_data(&part->cols[DISTIL_COL_MESSAGE]), offs_size)
+        || 0 > part_emit(part, -1, vmbuf_data(&part->msg_bytes), vmbuf_wlocpos(&part->msg_bytes)))
+        return -1;
+    part->block.col_len[DISTIL_COL_MESSAGE] += vmbuf_wlocpos(&part->msg_bytes);
+
+    vmbuf_memcpy(&part->blocks, &part->block, sizeof(part->block));
+    block_reset(part);
+    return 0;
+}
+
+static int
+part_open_segment (struct distil_columnar_writer *cw, struct distil_columnar_part *part, uint32_t partition) {
+    char path[PATH_MAX];
+    if (sizeof(path) <= (size_t)snprintf(path, sizeof(path), "%s/%u", cw->dir, partition))
+        return LOGGER_ERROR("path too long: %s", cw->dir), -1;
+    if (0 > mkdir(path, 0755) && EEXIST != errno)
+        return LOGGER_PERROR("cannot create %s", path), -1;
+
+    if (0 > distil_list_numbered(path, ".col", &part->scratch))
+        return -1;
+    size_t n = vmbuf_wlocpos(&part->scratch) / sizeof(uint32_t);
+    part->seq = n ? ((uint32_t *)vmbuf_data(&part->scratch))[n - 1] + 1 : 0;
+
+    if (sizeof(part->tmp_name) <= (size_t)snprintf(part->tmp_name, sizeof(part->tmp_name), "%s/.%u.col", path, part->seq))
+        return LOGGER_ERROR("path too long: %s", path), -1;
+    part->fd = open(part->tmp_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (0 > part->fd)
+        return LOGGER_PERROR("cannot create %s", part->tmp_name), -1;
+
+    part->partition = partition;
+    part->num_rows = 0;
+    part->ofs = 0;
+    vmbuf_reset(&part->blocks);
+    int col;
+    for (col = DISTIL_COL_HOST; col <= DISTIL_COL_TEMPLATE; ++col)
+        distil_dict_reset(&part->dicts[col]);
+    block_reset(part);
+
+    struct distil_columnar_header placeholder;
+    memset(&placeholder, 0, sizeof(placeholder));
+    return part_emit(part, -1, &placeholder, sizeof(placeholder));
+}
+
+static void
+part_init (struct distil_columnar_part *part) {
+    part->fd = -1;
+    int col;
+    for (col = DISTIL_COL_HOST; col <= DISTIL_COL_TEMPLATE; ++col)
+        distil_dict_init(&part->dicts[col]);
+    vmbuf_init(&part->cols[DISTIL_COL_TS], DISTIL_COLUMNAR_BLOCK_ROWS * sizeof(uint64_t));
+    for (col = DISTIL_COL_HOST; col < DISTIL_COL_MAX; ++col)
+        vmbuf_init(&part->cols[col], (DISTIL_COLUMNAR_BLOCK_ROWS + 1) * sizeof(uint32_t));
+    vmbuf_init(&part->msg_bytes, 16 * 1024 * 1024);
+    vmbuf_init(&part->blocks, DISTIL_COLUMNAR_SEGMENT_BLOCKS * sizeof(struct distil_columnar_block));
+    vmbuf_init(&part->scratch, DISTIL_COLUMNAR_BLOCK_ROWS * 10);
+}
+
+static void
+part_free (struct distil_columnar_part *part) {
+    int col;
+    for (col = 0; col < DISTIL_COL_MAX; ++col) {
+        if (DISTIL_COL_IS_DICT(col))
+            distil_dict_free(&part->dicts[col]);
+        vmbuf_free(&part->cols[col]);
+    }
+    vmbuf_free(&part->msg_bytes);
+    vmbuf_free(&part->blocks);
+    vmbuf_free(&part->scratch);
+}
+
+int
+distil_columnar_writer_init (struct distil_columnar_writer *cw, const char *dir) {
+    memset(cw, 0, sizeof(*cw));
+    cw->dir = strdup(dir);
+    if (0 > mkdir(dir, 0755) && EEXIST != errno)
+        return LOGGER_PERROR("cannot create %s", dir), -1;
+    int i;
+    for (i = 0; i < DISTIL_COLUMNAR_OPEN_PARTITIONS; ++i)
+        part_init(&cw->parts[i]);
+    return 0;
+}
+
+static void
+part_add_code (struct distil_columnar_part *part, int col, const char *str, size_t len) {
+    uint32_t code = distil_dict_intern(&part->dicts[col], str, len);
+    vmbuf_memcpy(&part->cols[col], &code, sizeof(code));
+    if (code < part->block.min_code[col])
+        part->block.min_code[col] = code;
+    if (code > part->block.max_code[col])
+        part->block.max_code[col] = code;
+}
+
+static int
+part_flush (struct distil_columnar_writer *cw, struct distil_columnar_part *part) {
+    if (0 > part->fd)
+        return 0;
+    if (0 > part_seal_block(part))
+        return -1;
+
+    struct distil_columnar_header header;
+    memset(&header, 0, sizeof(header));
+    header.magic = DISTIL_COLUMNAR_MAGIC;
+    header.version = DISTIL_COLUMNAR_VERSION;
+    header.num_rows = part->num_rows;
+    header.num_blocks = vmbuf_wlocpos(&part->blocks) / sizeof(struct distil_columnar_block);
+    header.min_ts = UINT64_MAX;
+
+    const struct distil_columnar_block *blocks = (const struct distil_columnar_block *)vmbuf_data(&part->blocks);
+    uint32_t b;
+    for (b = 0; b < header.num_blocks; ++b) {
+        if (blocks[b].min_ts < header.min_ts)
+            header.min_ts = blocks[b].min_ts;
+        if (blocks[b].max_ts > header.max_ts)
+            header.max_ts = blocks[b].max_ts;
+    }
+
+    if (0 > part_align(part))
+        return -1;
+    header.block_table_ofs = part->ofs;
+    if (0 > part_emit(part, -1, vmbuf_data(&part->blocks), vmbuf_wlocpos(&part->blocks)))
+        return -1;
+
+    int col;
+    for (col = DISTIL_COL_HOST; col <= DISTIL_COL_TEMPLATE; ++col) {
+        struct distil_dict *dict = &part->dicts[col];
+        const uint32_t *entries = (const uint32_t *)vmbuf_data(&dict->entries);
+        uint32_t count = dict->num_entries, i;
+        vmbuf_reset(&part->scratch);
+        vmbuf_memcpy(&part->scratch, &count, sizeof(count));
+        for (i = 0; i < count; ++i)
+            vmbuf_memcpy(&part->scratch, &entries[2 * i], sizeof(uint32_t));
+        uint32_t end = vmbuf_wlocpos(&dict->bytes);
+        vmbuf_memcpy(&part->scratch, &end, sizeof(end));
+        vmbuf_memcpy(&part->scratch, vmbuf_data(&dict->bytes), end);
+        if (0 > part_align(part))
+            return -1;
+        header.dict_ofs[col] = part->ofs;
+        if (0 > part_emit(part, -1, vmbuf_data(&part->scratch), vmbuf_wlocpos(&part->scratch)))
+            return -1;
+    }
+
+    if (sizeof(header) != pwrite(part->fd, &header, sizeof(header), 0))
+        return LOGGER_PERROR("cannot write %s", part->tmp_name), -1;
+    if (0 > fdatasync(part->fd))
+        LOGGER_PERROR("fdatasync: %s", part->tmp_name);
+    close(part->fd);
+    part->fd = -1;
+
+    char path[sizeof(part->tmp_name)]; // tmp_name without the dot, fits
+    snprintf(path, sizeof(path), "%s/%u/%u.col", cw->dir, part->partition, part->seq);
+    part->partition = 0;
+    if (0 > rename(part->tmp_name, path))
+        return LOGGER_PERROR("cannot publish %s", path), -1;
+    LOGGER_INFO("columnar segment %s: %u rows", path, header.num_rows);
+    return 0;
+}
+
+int
+distil_columnar_writer_flush (struct distil_columnar_writer *cw) {
+    int res = 0, i;
+    for (i = 0; i < DISTIL_COLUMNAR_OPEN_PARTITIONS; ++i) {
+        if (0 > part_flush(cw, &cw->parts[i]))
+            res = -1;
+    }
+    return res;
+}
+
+int
+distil_columnar_writer_close (struct distil_columnar_writer *cw) {
+    int res = distil_columnar_writer_flush(cw);
+    int i;
+    for (i = 0; i < DISTIL_COLUMNAR_OPEN_PARTITIONS; ++i)
+        part_free(&cw->parts[i]);
+    free(cw->dir);
+    return res;
+}
+
+
+/* the part building this partition's segment, the least recently used one is sealed to make room */
+static struct distil_columnar_part *
+writer_part (struct distil_columnar_writer *cw, uint32_t partition) {
+    struct distil_columnar_part *victim = NULL;
+    int i;
+    for (i = 0; i < DISTIL_COLUMNAR_OPEN_PARTITIONS; ++i) {
+        struct distil_columnar_part *part = &cw->parts[i];
+        if (0 > part->fd) {
+            if (NULL == victim || 0 <= victim->fd)
+                victim = part;
+            continue;
+        }
+        if (part->partition == partition)
+            return part;
+        if (NULL == victim || (0 <= victim->fd && part->last_used < victim->last_used))
+            victim = part;
+    }
+    if (0 > part_flush(cw, victim) || 0 > part_open_segment(cw, victim, partition))
+        return NULL;
+    return victim;
+}
+
+int
+distil_columnar_writer_add (struct distil_columnar_writer *cw, const struct distil_record *rec) {
+    struct distil_columnar_part *part = writer_part(cw, partition_of(rec->ts));
+    if (NULL == part)
+        return -1;
+    part->last_used = ++cw->clock;
+
+    vmbuf_memcpy(&part->cols[DISTIL_COL_TS], &rec->ts, sizeof(rec->ts));
+    if (rec->ts < part->block.min_ts)
+        part->block.min_ts = rec->ts;
+    if (rec->ts > part->block.max_ts)
+        part->block.max_ts = rec->ts;
+
+    char template[DISTIL_COLUMNAR_TEMPLATE_MAX];
+    size_t template_len = distil_columnar_template(rec->message, rec->message_len, template, sizeof(template));
+    part_add_code(part, DISTIL_COL_HOST, rec->host, rec->host_len);
+    part_add_code(part, DISTIL_COL_FILE, rec->file, rec->file_len);
+    part_add_code(part, DISTIL_COL_LEVEL, rec->level, rec->level_len);
+    part_add_code(part, DISTIL_COL_TEMPLATE, template, template_len);
+
+    vmbuf_memcpy(&part->msg_bytes, rec->message, rec->message_len);
+    uint32_t end = vmbuf_wlocpos(&part->msg_bytes);
+    vmbuf_memcpy(&part->cols[DISTIL_COL_MESSAGE], &end, sizeof(end));
+
+    ++part->num_rows;
+    if (DISTIL_COLUMNAR_BLOCK_ROWS == ++part->block.num_rows) {
+        if (0 > part_seal_block(part))
+            return -1;
+        if (DISTIL_COLUMNAR_SEGMENT_BLOCKS == vmbuf_wlocpos(&part->blocks) / sizeof(struct distil_columnar_block))
+            return part_flush(cw, part);
+    }
+    return 0;
+}
+
+/*
+ * reader
+ */
+
+int
+distil_columnar_segment_open (struct distil_columnar_segment *seg, const char *path) {
+    memset(seg, 0, sizeof(*seg));
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (0 > fd)
+        return LOGGER_PERROR("cannot open %s", path), -1;
+    struct stat st;
+    if (0 > fstat(fd, &st)) {
+        close(fd);
+        return LOGGER_PERROR("cannot stat %s", path), -1;
+    }
+    if ((size_t)st.st_size < sizeof(struct distil_columnar_header)) {
+        close(fd);
+        return LOGGER_ERROR("%s: truncated segment", path), -1;
+    }
+    void *mem = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (MAP_FAILED == mem)
+        return LOGGER_PERROR("cannot map %s", path), -1;
+
+    seg->mem = (const char *)mem;
+    seg->size = st.st_size;
+    seg->header = (const struct distil_columnar_header *)mem;
+    if (DISTIL_COLUMNAR_MAGIC != seg->header->magic
+        || DISTIL_COLUMNAR_VERSION != seg->header->version
+        || seg->header->block_table_ofs + seg->header->num_blocks * sizeof(struct distil_columnar_block) > seg->size) {
+        LOGGER_ERROR("%s: bad header", path);
+        return distil_columnar_segment_close(seg), -1;
+    }
+    seg->blocks = (const struct distil_columnar_block *)(seg->mem + seg->header->block_table_ofs);
+    return 0;
+}
+
+void
+distil_columnar_segment_close (struct distil_columnar_segment *seg) {
+    if (NULL != seg->mem)
+        munmap((void *)seg->mem, seg->size);
+    memset(seg, 0, sizeof(*seg));
+}
+
+const char *
+distil_columnar_dict_get (const struct distil_columnar_segment *seg, int col, uint32_t code, size_t *len) {
+    const uint32_t *dict = (const uint32_t *)(seg->mem + seg->header->dict_ofs[col]);
+    uint32_t count = dict[0];
+    const uint32_t *offsets = dict + 1;
+    const char *bytes = (const char *)(offsets + count + 1);
+    *len = offsets[code + 1] - offsets[code];
+    return bytes + offsets[code];
+}
+
+/* code of value in the segment's dictionary of col. false if the segment doesn't have it */
+static bool
+dict_lookup (const struct distil_columnar_segment *seg, int col, const char *value, uint32_t *code) {
+    uint32_t count = *(const uint32_t *)(seg->mem + seg->header->dict_ofs[col]);
+    size_t len = strlen(value);
+    for (*code = 0; *code < count; ++*code) {
+        size_t elen;
+        const char *e = distil_columnar_dict_get(seg, col, *code, &elen);
+        if (elen == len && 0 == memcmp(e, value, len))
+            return true;
+    }
+    return false;
+}
+
+static ssize_t
+scan_segment (
+    const struct distil_columnar_segment *seg,
+    const struct distil_columnar_query *query, uint32_t mask,
+    distil_columnar_row_cb cb, void *arg) {
+
+    uint64_t from = query->from, to = query->to;
+    uint32_t want[DISTIL_COL_MAX];
+    uint32_t preds = 0;
+    int col;
+    for (col = DISTIL_COL_HOST; col <= DISTIL_COL_TEMPLATE; ++col) {
+        if (NULL == query->equals[col])
+            continue;
+        if (!dict_lookup(seg, col, query->equals[col], &want[col]))
+            return 0;
+        preds |= DISTIL_COL_MASK(col);
+    }
+
+    ssize_t rows = 0;
+    uint32_t b;
+    for (b = 0; b < seg->header->num_blocks; ++b) {
+        const struct distil_columnar_block *block = seg->blocks + b;
+        if (block->max_ts < from || block->min_ts > to)
+            continue;
+        bool skip = false;
+        for (col = DISTIL_COL_HOST; col <= DISTIL_COL_TEMPLATE && !skip; ++col) {
+            if (preds & DISTIL_COL_MASK(col))
+                skip = want[col] < block->min_code[col] || want[col] > block->max_code[col];
+        }
+        if (skip)
+            continue;
+
+        const uint8_t *p = (const uint8_t *)seg->mem + block->col_ofs[DISTIL_COL_TS];
+        const uint8_t *end = p + block->col_len[DISTIL_COL_TS];
+        const uint32_t *codes[DISTIL_COL_MAX];
+        for (col = DISTIL_COL_HOST; col <= DISTIL_COL_TEMPLATE; ++col)
+            codes[col] = (const uint32_t *)(seg->mem + block->col_ofs[col]);
+        const uint32_t *msg_offs = (const uint32_t *)(seg->mem + block->col_ofs[DISTIL_COL_MESSAGE]);
+        const char *msg_bytes = (const char *)(msg_offs + block->num_rows + 1);
+
+        struct distil_columnar_row row;
+        memset(&row, 0, sizeof(row));
+        uint64_t ts = block->min_ts, zz;
+        uint32_t i;
+        for (i = 0; i < block->num_rows; ++i) {
+            if (NULL == (p = distil_varint64_decode(p, end, &zz)))
+                return LOGGER_ERROR("%s", "corrupt timestamp column"), -1;
+            ts += (uint64_t)((int64_t)(zz >> 1) ^ -(int64_t)(zz & 1));
+            if (ts < from || ts > to)
+                continue;
+            for (col = DISTIL_COL_HOST; col <= DISTIL_COL_TEMPLATE && !skip; ++col) {
+                if (preds & DISTIL_COL_MASK(col))
+                    skip = codes[col][i] != want[col];
+            }
+            if (skip) {
+                skip = false;
+                continue;
+            }
+            row.ts = ts;
+            for (col = DISTIL_COL_HOST; col <= DISTIL_COL_TEMPLATE; ++col) {
+                if (mask & DISTIL_COL_MASK(col))
+                    row.val[col] = distil_columnar_dict_get(seg, col, codes[col][i], &row.len[col]);
+            }
+            if (mask & DISTIL_COL_MASK(DISTIL_COL_MESSAGE)) {
+                row.val[DISTIL_COL_MESSAGE] = msg_bytes + msg_offs[i];
+                row.len[DISTIL_COL_MESSAGE] = msg_offs[i + 1] - msg_offs[i];
+            }
+            cb(&row, arg);
+            ++rows;
+        }
+    }
+    return rows;
+}
+
+ssize_t
+distil_columnar_scan (
+    const char *dir,
+    const struct distil_columnar_query *query,
+    uint32_t mask,
+    distil_columnar_row_cb cb,
+    void *arg) {
+
+    struct distil_columnar_query q = *query;
+    if (0 == q.to)
+        q.to = UINT64_MAX;
+    uint64_t from = q.from, to = q.to;
+
+    struct vmbuf partitions = VMBUF_INITIALIZER, seqs = VMBUF_INITIALIZER;
+    vmbuf_init(&partitions, 4096);
+    vmbuf_init(&seqs, 4096);
+
+    ssize_t rows = 0;
+    if (0 > distil_list_numbered(dir, "", &partitions))
+        rows = -1;
+
+    size_t i, num_partitions = vmbuf_wlocpos(&partitions) / sizeof(uint32_t);
+    for (i = 0; i < num_partitions && 0 <= rows; ++i) {
+        uint32_t partition = ((uint32_t *)vmbuf_data(&partitions))[i];
+        uint64_t start = partition_start(partition);
+        if (start > to || start + DAY_MS <= from)
+            continue;
+
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%u", dir, partition);
+        if (0 > distil_list_numbered(path, ".col", &seqs)) {
+            rows = -1;
+            break;
+        }
+        size_t k, num_seqs = vmbuf_wlocpos(&seqs) / sizeof(uint32_t);
+        for (k = 0; k < num_seqs && 0 <= rows; ++k) {
+            snprintf(path, sizeof(path), "%s/%u/%u.col", dir, partition, ((uint32_t *)vmbuf_data(&seqs))[k]);
+            struct distil_columnar_segment seg;
+            if (0 > distil_columnar_segment_open(&seg, path))
+                continue;
+            if (seg.header->max_ts >= from && seg.header->min_ts <= to) {
+                ssize_t res = scan_segment(&seg, &q, mask, cb, arg);
+                rows = 0 > res ? -1 : rows + res;
+            }
+            distil_columnar_segment_close(&seg);
+        }
+    }
+
+    vmbuf_free(&partitions);
+    vmbuf_free(&seqs);
+    return rows;
+}
@@ -0,0 +1,75 @@
+#include "distil_dict.h"
+
+#include <string.h>
+
+#define DISTIL_DICT_MIN_SLOTS 1024
+
+
+static void
+dict_rehash (struct distil_dict *dict, uint32_t num_slots) {
+    vmbuf_reset(&dict->slots);
+    vmbuf_resize_if_less(&dict->slots, num_slots * sizeof(uint32_t));
+    memset(vmbuf_data(&dict->slots), 0, num_slots * sizeof(uint32_t));
+    vmbuf_wseek(&dict->slots, num_slots * sizeof(uint32_t));
+    dict->num_slots = num_slots;
+
+    uint32_t *slots = (uint32_t *)vmbuf_data(&dict->slots);
+    uint32_t id;
+    for (id = 0; id < dict->num_entries; ++id) {
+        size_t len;
+        const char *str = distil_dict_get(dict, id, &len);
+        uint32_t h = distil_hash(str, len) & (num_slots - 1);
+        while (slots[h])
+            h = (h + 1) & (num_slots - 1);
+        slots[h] = id + 1;
+    }
+}
+
+int
+distil_dict_init (struct distil_dict *dict) {
+    memset(dict, 0, sizeof(*dict));
+    vmbuf_init(&dict->bytes, 64 * 1024);
+    vmbuf_init(&dict->entries, 64 * 1024);
+    vmbuf_init(&dict->slots, DISTIL_DICT_MIN_SLOTS * sizeof(uint32_t));
+    dict_rehash(dict, DISTIL_DICT_MIN_SLOTS);
+    return 0;
+}
+
+uint32_t
+distil_dict_intern (struct distil_dict *dict, const char *str, size_t len) {
+    if (dict->num_entries * 2 >= dict->num_slots)
+        dict_rehash(dict, dict->num_slots * 2);
+
+    uint32_t mask = dict->num_slots - 1;
+    uint32_t h = distil_hash(str, len) & mask;
+    uint32_t *slots = (uint32_t *)vmbuf_data(&dict->slots);
+    while (slots[h]) {
+        size_t elen;
+        const char *e = distil_dict_get(dict, slots[h] - 1, &elen);
+        if (elen == len && 0 == memcmp(e, str, len))
+            return slots[h] - 1;
+        h = (h + 1) & mask;
+    }
+
+    uint32_t entry[2] = { vmbuf_wlocpos(&dict->bytes), len };
+    vmbuf_memcpy(&dict->entries, entry, sizeof(entry));
+    vmbuf_memcpy(&dict->bytes, str, len);
+    slots[h] = ++dict->num_entries;
+    return dict->num_entries - 1;
+}
+
+void
+distil_dict_reset (struct distil_dict *dict) {
+    vmbuf_reset(&dict->bytes);
+    vmbuf_reset(&dict->entries);
+    dict->num_entries = 0;
+    memset(vmbuf_data(&dict->slots), 0, dict->num_slots * sizeof(uint32_t));
+}
+
+void
+distil_dict_free (struct distil_dict *dict) {
+    vmbuf_free(&dict->bytes);
+    vmbuf_free(&dict->entries);
+    vmbuf_free(&dict->slots);
+    dict->num_entries = dict->num_slots = 0;
+}
@@ -0,0 +1,567 @@
+#include "distil_index.h"
+#include "distil_utils.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define DISTIL_INDEX_WRITE_CHUNK (1024 * 1024)
+
+/* in-memory term stats while a segment is being built */
+struct distil_index_term {
+    uint32_t last_doc;
+    uint32_t df;
+};
+
+struct distil_query_term {
+    const char *term;
+    size_t len;
+    int group;
+    const struct distil_term_entry *entry;
+};
+
+
+static int
+write_file (const char *path, const void *data, size_t size) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (0 > fd)
+        return LOGGER_PERROR("cannot create %s", path), -1;
+    if (0 > distil_write_fully(fd, data, size)) {
+        LOGGER_PERROR("cannot write %s", path);
+        close(fd);
+        return -1;
+    }
+    return close(fd);
+}
+
+static int
+cmp_term_ids (const void *a, const void *b, void *arg) {
+    struct distil_dict *terms = (struct distil_dict *)arg;
+    size_t xlen, ylen;
+    const char *x = distil_dict_get(terms, *(const uint32_t *)a, &xlen);
+    const char *y = distil_dict_get(terms, *(const uint32_t *)b, &ylen);
+    return distil_cmp_bytes(x, xlen, y, ylen);
+}
+
+
+/*
+ * writer
+ */
+
+static int
+writer_open_segment (struct distil_index_writer *iw) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%u.docs", iw->dir, iw->seq);
+    iw->docs_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (0 > iw->docs_fd)
+        return LOGGER_PERROR("cannot create %s", path), -1;
+    iw->docs_ofs = 0;
+    iw->num_docs = 0;
+    iw->min_ts = UINT64_MAX;
+    iw->max_ts = 0;
+    vmbuf_reset(&iw->docs);
+    vmbuf_reset(&iw->doffs);
+    distil_dict_reset(&iw->terms);
+    vmbuf_reset(&iw->term_stats);
+    vmbuf_reset(&iw->pairs);
+    return 0;
+}
+
+int
+distil_index_writer_init (struct distil_index_writer *iw, const char *dir) {
+    memset(iw, 0, sizeof(*iw));
+    iw->docs_fd = -1;
+    iw->dir = strdup(dir);
+    if (0 > mkdir(dir, 0755) && EEXIST != errno)
+        return LOGGER_PERROR("cannot create %s", dir), -1;
+
+    struct vmbuf seqs = VMBUF_INITIALIZER;
+    vmbuf_init(&seqs, 4096);
+    if (0 > distil_list_numbered(dir, ".terms", &seqs))
+        return vmbuf_free(&seqs), -1;
+    size_t n = vmbuf_wlocpos(&seqs) / sizeof(uint32_t);
+    iw->seq = n ? ((uint32_t *)vmbuf_data(&seqs))[n - 1] + 1 : 0;
+    vmbuf_free(&seqs);
+
+    vmbuf_init(&iw->docs, DISTIL_INDEX_WRITE_CHUNK * 2);
+    vmbuf_init(&iw->doffs, DISTIL_INDEX_SEGMENT_DOCS * sizeof(struct distil_doc_entry));
+    vmbuf_init(&iw->term_stats, 1024 * 1024);
+    vmbuf_init(&iw->pairs, 16 * 1024 * 1024);
+    return distil_dict_init(&iw->terms);
+}
+
+int
+distil_index_writer_add (struct distil_index_writer *iw, const struct distil_record *rec) {
+    if (0 > iw->docs_fd && 0 > writer_open_segment(iw))
+        return -1;
+
+    uint32_t doc = iw->num_docs++;
+    struct distil_doc_entry de = { iw->docs_ofs, rec->ts };
+    vmbuf_memcpy(&iw->doffs, &de, sizeof(de));
+    vmbuf_memcpy(&iw->docs, rec->raw, rec->raw_len);
+    vmbuf_chrcpy(&iw->docs, '\n');
+    iw->docs_ofs += rec->raw_len + 1;
+    if (rec->ts < iw->min_ts)
+        iw->min_ts = rec->ts;
+    if (rec->ts > iw->max_ts)
+        iw->max_ts = rec->ts;
+
+    if (DISTIL_INDEX_WRITE_CHUNK <= vmbuf_wlocpos(&iw->docs)) {
+        if (0 > distil_write_fully(iw->docs_fd, vmbuf_data(&iw->docs), vmbuf_wlocpos(&iw->docs)))
+            return LOGGER_PERROR("cannot write index segment %u", iw->seq), -1;
+        vmbuf_reset(&iw->docs);
+    }
+
+    const char *p = rec->raw, *end = rec->raw + rec->raw_len;
+    size_t len;
+    while (NULL != (p = distil_next_token(p, end, &len))) {
+        uint32_t id = distil_dict_intern(&iw->terms, p, len);
+        if (id == vmbuf_wlocpos(&iw->term_stats) / sizeof(struct distil_index_term)) {
+            struct distil_index_term fresh = { UINT32_MAX, 0 };
+            vmbuf_memcpy(&iw->term_stats, &fresh, sizeof(fresh));
+        }
+        struct distil_index_term *t = (struct distil_index_term *)vmbuf_data(&iw->term_stats) + id;
+        if (t->last_doc != doc) {
+            t->last_doc = doc;
+            ++t->df;
+            uint32_t pair[2] = { id, doc };
+            vmbuf_memcpy(&iw->pairs, pair, sizeof(pair));
+        }
+        p += len;
+    }
+
+    if (DISTIL_INDEX_SEGMENT_DOCS == iw->num_docs)
+        return distil_index_writer_flush(iw);
+    return 0;
+}
+
+/* seals the segment being built: postings grouped per term, terms sorted */
+int
+distil_index_writer_flush (struct distil_index_writer *iw) {
+    if (0 > iw->docs_fd)
+        return 0;
+
+    char path[PATH_MAX], tmp_path[PATH_MAX];
+    if (0 > distil_write_fully(iw->docs_fd, vmbuf_data(&iw->docs), vmbuf_wlocpos(&iw->docs)))
+        return LOGGER_PERROR("cannot write index segment %u", iw->seq), -1;
+    close(iw->docs_fd);
+    iw->docs_fd = -1;
+
+    snprintf(path, sizeof(path), "%s/%u.doff", iw->dir, iw->seq);
+    if (0 > write_file(path, vmbuf_data(&iw->doffs), vmbuf_wlocpos(&iw->doffs)))
+        return -1;
+
+    const struct distil_index_term *terms = (const struct distil_index_term *)vmbuf_data(&iw->term_stats);
+    uint32_t num_terms = iw->terms.num_entries;
+    const uint32_t *pairs = (const uint32_t *)vmbuf_data(&iw->pairs);
+    size_t num_pairs = vmbuf_wlocpos(&iw->pairs) / (2 * sizeof(uint32_t));
+
+    // counting sort of (term, doc) by term keeps docs ascending within a term
+    struct vmbuf starts = VMBUF_INITIALIZER, sorted = VMBUF_INITIALIZER, order = VMBUF_INITIALIZER;
+    struct vmbuf post = VMBUF_INITIALIZER, entries = VMBUF_INITIALIZER, bytes = VMBUF_INITIALIZER;
+    vmbuf_init(&starts, (num_terms + 1) * sizeof(uint32_t));
+    vmbuf_init(&sorted, (num_pairs + 1) * sizeof(uint32_t));
+    vmbuf_init(&order, (num_terms + 1) * sizeof(uint32_t));
+    vmbuf_init(&post, num_pairs * 2 + 4096);
+    vmbuf_init(&entries, (num_terms + 1) * sizeof(struct distil_term_entry));
+    vmbuf_init(&bytes, vmbuf_wlocpos(&iw->terms.bytes) + 4096);
+
+    uint32_t *cursor = (uint32_t *)vmbuf_data(&starts);
+    uint32_t *docs = (uint32_t *)vmbuf_data(&sorted);
+    uint32_t *ids = (uint32_t *)vmbuf_data(&order);
+    uint32_t id, total = 0;
+    for (id = 0; id < num_terms; ++id) {
+        cursor[id] = total;
+        total += terms[id].df;
+        ids[id] = id;
+    }
+    size_t i;
+    for (i = 0; i < num_pairs; ++i)
+        docs[cursor[pairs[2 * i]]++] = pairs[2 * i + 1];
+    qsort_r(ids, num_terms, sizeof(uint32_t), cmp_term_ids, &iw->terms);
+
+    for (i = 0; i < num_terms; ++i) {
+        const struct distil_index_term *t = terms + ids[i];
+        const uint32_t *tdocs = docs + cursor[ids[i]] - t->df; // cursor ends past its run
+        size_t term_len;
+        const char *term = distil_dict_get(&iw->terms, ids[i], &term_len);
+        struct distil_term_entry e = { vmbuf_wlocpos(&bytes), term_len, vmbuf_wlocpos(&post), 0, t->df };
+        vmbuf_memcpy(&bytes, term, term_len);
+
+        uint32_t k, prev = 0;
+        for (k = 0; k < t->df; ++k) {
+            vmbuf_resize_if_less(&post, 5);
+            vmbuf_wseek(&post, distil_varint_encode((uint8_t *)vmbuf_wloc(&post), tdocs[k] - prev));
+            prev = tdocs[k];
+        }
+        e.post_len = vmbuf_wlocpos(&post) - e.post_ofs;
+        vmbuf_memcpy(&entries, &e, sizeof(e));
+    }
+
+    int res = -1;
+    snprintf(path, sizeof(path), "%s/%u.post", iw->dir, iw->seq);
+    if (0 > write_file(path, vmbuf_data(&post), vmbuf_wlocpos(&post)))
+        goto out;
+
+    struct distil_index_header header = {
+        DISTIL_INDEX_MAGIC, DISTIL_INDEX_VERSION, num_terms, iw->num_docs, iw->min_ts, iw->max_ts
+    };
+    snprintf(tmp_path, sizeof(tmp_path), "%s/.%u.terms", iw->dir, iw->seq);
+    snprintf(path, sizeof(path), "%s/%u.terms", iw->dir, iw->seq);
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (0 > fd) {
+        LOGGER_PERROR("cannot create %s", tmp_path);
+        goto out;
+    }
+    if (0 > distil_write_fully(fd, &header, sizeof(header))
+        || 0 > distil_write_fully(fd, vmbuf_data(&entries), vmbuf_wlocpos(&entries))
+        || 0 > distil_write_fully(fd, vmbuf_data(&bytes), vmbuf_wlocpos(&bytes))) {
+        LOGGER_PERROR("cannot write %s", tmp_path);
+        close(fd);
+        goto out;
+    }
+    close(fd);
+    if (0 > rename(tmp_path, path)) {
+        LOGGER_PERROR("cannot publish %s", path);
+        goto out;
+    }
+    LOGGER_INFO("index segment %u: %u docs, %u terms", iw->seq, iw->num_docs, num_terms);
+    ++iw->seq;
+    res = 0;
+out:
+    vmbuf_free(&starts);
+    vmbuf_free(&sorted);
+    vmbuf_free(&order);
+    vmbuf_free(&post);
+    vmbuf_free(&entries);
+    vmbuf_free(&bytes);
+    return res;
+}
+
+int
+distil_index_writer_close (struct distil_index_writer *iw) {
+    int res = 0 < iw->num_docs ? distil_index_writer_flush(iw) : 0;
+    if (0 <= iw->docs_fd) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%u.docs", iw->dir, iw->seq);
+        close(iw->docs_fd);
+        unlink(path);
+    }
+    vmbuf_free(&iw->docs);
+    vmbuf_free(&iw->doffs);
+    distil_dict_free(&iw->terms);
+    vmbuf_free(&iw->term_stats);
+    vmbuf_free(&iw->pairs);
+    free(iw->dir);
+    return res;
+}
+
+
+/*
+ * reader
+ */
+
+static const void *
+map_file (const char *dir, uint32_t seq, const char *ext, size_t *size) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%u.%s", dir, seq, ext);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (0 > fd)
+        return LOGGER_PERROR("cannot open %s", path), NULL;
+    struct stat st;
+    if (0 > fstat(fd, &st)) {
+        close(fd);
+        return LOGGER_PERROR("cannot stat %s", path), NULL;
+    }
+    *size = st.st_size;
+    if (0 == st.st_size) {
+        close(fd);
+        return "";
+    }
+    void *mem = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (MAP_FAILED == mem)
+        return LOGGER_PERROR("cannot map %s", path), NULL;
+    return mem;
+}
+
+static void
+unmap_file (const void *mem, size_t size) {
+    if (NULL != mem && 0 < size)
+        munmap((void *)mem, size);
+}
+
+int
+distil_index_segment_open (struct distil_index_segment *seg, const char *dir, uint32_t seq) {
+    memset(seg, 0, sizeof(*seg));
+    seg->seq = seq;
+    seg->header = (const struct distil_index_header *)map_file(dir, seq, "terms", &seg->terms_size);
+    if (NULL == seg->header)
+        return -1;
+    if (sizeof(*seg->header) > seg->terms_size
+        || DISTIL_INDEX_MAGIC != seg->header->magic
+        || DISTIL_INDEX_VERSION != seg->header->version) {
+        LOGGER_ERROR("index segment %u: bad header", seq);
+        return distil_index_segment_close(seg), -1;
+    }
+    seg->entries = (const struct distil_term_entry *)(seg->header + 1);
+    seg->term_bytes = (const char *)(seg->entries + seg->header->num_terms);
+    seg->post = (const uint8_t *)map_file(dir, seq, "post", &seg->post_size);
+    seg->doffs = (const struct distil_doc_entry *)map_file(dir, seq, "doff", &seg->doff_size);
+    seg->docs = (const char *)map_file(dir, seq, "docs", &seg->docs_size);
+    if (NULL == seg->post || NULL == seg->doffs || NULL == seg->docs)
+        return distil_index_segment_close(seg), -1;
+    return 0;
+}
+
+void
+distil_index_segment_close (struct distil_index_segment *seg) {
+    unmap_file(seg->header, seg->terms_size);
+    unmap_file(seg->post, seg->post_size);
+    unmap_file(seg->doffs, seg->doff_size);
+    unmap_file(seg->docs, seg->docs_size);
+    memset(seg, 0, sizeof(*seg));
+}
+
+const struct distil_term_entry *
+distil_index_segment_lookup (const struct distil_index_segment *seg, const char *term, size_t len) {
+    uint32_t lo = 0, hi = seg->header->num_terms;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        const struct distil_term_entry *e = seg->entries + mid;
+        int res = distil_cmp_bytes(seg->term_bytes + e->term_ofs, e->term_len, term, len);
+        if (0 == res)
+            return e;
+        if (0 > res)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return NULL;
+}
+
+const char *
+distil_index_segment_doc (const struct distil_index_segment *seg, uint32_t doc, size_t *len) {
+    uint64_t ofs = seg->doffs[doc].ofs;
+    uint64_t next = doc + 1 < seg->header->num_docs ? seg->doffs[doc + 1].ofs : seg->docs_size;
+    *len = next - ofs - 1;
+    return seg->docs + ofs;
+}
+
+static int
+decode_postings (const struct distil_index_segment *seg, const struct distil_term_entry *e, struct vmbuf *out) {
+    vmbuf_reset(out);
+    vmbuf_resize_if_less(out, e->df * sizeof(uint32_t));
+    uint32_t *docs = (uint32_t *)vmbuf_data(out);
+    const uint8_t *p = seg->post + e->post_ofs, *end = p + e->post_len;
+    uint32_t k, doc = 0, delta;
+    for (k = 0; k < e->df; ++k) {
+        if (NULL == (p = distil_varint_decode(p, end, &delta)))
+            return LOGGER_ERROR("index segment %u: corrupt postings", seg->seq), -1;
+        doc += delta;
+        docs[k] = doc;
+    }
+    vmbuf_wseek(out, e->df * sizeof(uint32_t));
+    return 0;
+}
+
+/* out = a AND b, or a OR b */
+static void
+merge_docs (struct vmbuf *a, struct vmbuf *b, struct vmbuf *out, bool intersect) {
+    const uint32_t *x = (const uint32_t *)vmbuf_data(a), *y = (const uint32_t *)vmbuf_data(b);
+    size_t nx = vmbuf_wlocpos(a) / sizeof(uint32_t), ny = vmbuf_wlocpos(b) / sizeof(uint32_t);
+    vmbuf_reset(out);
+    vmbuf_resize_if_less(out, (nx + ny) * sizeof(uint32_t));
+    uint32_t *o = (uint32_t *)vmbuf_data(out);
+    size_t i = 0, j = 0, n = 0;
+    while (i < nx && j < ny) {
+        if (x[i] == y[j]) {
+            o[n++] = x[i++];
+            ++j;
+        } else if (x[i] < y[j]) {
+            if (!intersect)
+                o[n++] = x[i];
+            ++i;
+        } else {
+            if (!intersect)
+                o[n++] = y[j];
+            ++j;
+        }
+    }
+    if (!intersect) {
+        for (; i < nx; ++i) o[n++] = x[i];
+        for (; j < ny; ++j) o[n++] = y[j];
+    }
+    vmbuf_wseek(out, n * sizeof(uint32_t));
+}
+
+static void
+swap_vmbuf (struct vmbuf *a, struct vmbuf *b) {
+    struct vmbuf t = *a;
+    *a = *b;
+    *b = t;
+}
+
+/* -1 if there are more terms than fit, dropping some would widen the query */
+static ssize_t
+parse_query (char *expr, struct distil_query_term *qterms, int *num_groups) {
+    size_t n = 0;
+    int group = 0;
+    bool group_used = false;
+    char *sp, *word;
+    for (word = strtok_r(expr, " \t", &sp); word; word = strtok_r(NULL, " \t", &sp)) {
+        if (0 == strcmp(word, "OR")) {
+            if (group_used)
+                ++group;
+            group_used = false;
+            continue;
+        }
+        if (0 == strcmp(word, "AND"))
+            continue;
+        const char *p = word, *end = word + strlen(word);
+        size_t len;
+        while (NULL != (p = distil_next_token(p, end, &len))) {
+            if (DISTIL_QUERY_MAX_TERMS == n)
+                return -1;
+            qterms[n].term = p;
+            qterms[n].len = len;
+            qterms[n].group = group;
+            ++n;
+            group_used = true;
+            p += len;
+        }
+    }
+    *num_groups = group_used ? group + 1 : group;
+    return n;
+}
+
+static ssize_t
+query_segment (
+    const struct distil_index_segment *seg,
+    struct distil_query_term *qterms, size_t num_terms, int num_groups,
+    uint64_t from, uint64_t to,
+    struct vmbuf *result, struct vmbuf *acc, struct vmbuf *dec, struct vmbuf *tmp,
+    distil_index_match_cb cb, void *arg) {
+
+    const struct distil_index_header *h = seg->header;
+    uint32_t doc;
+    ssize_t matches = 0;
+    if (0 == num_terms) {
+        for (doc = 0; doc < h->num_docs; ++doc) {
+            if (seg->doffs[doc].ts >= from && seg->doffs[doc].ts <= to)
+                cb(seg, doc, arg), ++matches;
+        }
+        return matches;
+    }
+
+    vmbuf_reset(result);
+    int g;
+    for (g = 0; g < num_groups; ++g) {
+        struct distil_query_term *gterms[DISTIL_QUERY_MAX_TERMS];
+        size_t i, n = 0;
+        bool missing = false;
+        for (i = 0; i < num_terms; ++i) {
+            if (qterms[i].group != g)
+                continue;
+            qterms[i].entry = distil_index_segment_lookup(seg, qterms[i].term, qterms[i].len);
+            if (NULL == qterms[i].entry) {
+                missing = true;
+                break;
+            }
+            // rarest first keeps the intersections short
+            size_t k = n++;
+            while (0 < k && gterms[k - 1]->entry->df > qterms[i].entry->df) {
+                gterms[k] = gterms[k - 1];
+                --k;
+            }
+            gterms[k] = &qterms[i];
+        }
+        if (missing || 0 == n)
+            continue;
+
+        if (0 > decode_postings(seg, gterms[0]->entry, acc))
+            return -1;
+        for (i = 1; i < n && 0 < vmbuf_wlocpos(acc); ++i) {
+            if (0 > decode_postings(seg, gterms[i]->entry, dec))
+                return -1;
+            merge_docs(acc, dec, tmp, true);
+            swap_vmbuf(acc, tmp);
+        }
+        merge_docs(result, acc, tmp, false);
+        swap_vmbuf(result, tmp);
+    }
+
+    const uint32_t *docs = (const uint32_t *)vmbuf_data(result);
+    size_t i, n = vmbuf_wlocpos(result) / sizeof(uint32_t);
+    for (i = 0; i < n; ++i) {
+        uint64_t ts = seg->doffs[docs[i]].ts;
+        if (ts >= from && ts <= to)
+            cb(seg, docs[i], arg), ++matches;
+    }
+    return matches;
+}
+
+ssize_t
+distil_index_query (
+    const char *dir,
+    const char *expr,
+    uint64_t from,
+    uint64_t to,
+    distil_index_match_cb cb,
+    void *arg) {
+
+    if (0 == to)
+        to = UINT64_MAX;
+
+    char *query = strdup(expr ? expr : "");
+    struct distil_query_term qterms[DISTIL_QUERY_MAX_TERMS];
+    int num_groups;
+    bool has_words = strspn(query, " \t") != strlen(query);
+    ssize_t num_terms = parse_query(query, qterms, &num_groups);
+    if (0 > num_terms) {
+        free(query);
+        return LOGGER_ERROR("more than %d terms in query: %s", DISTIL_QUERY_MAX_TERMS, expr), -1;
+    }
+    if (has_words && 0 == num_terms) {
+        free(query);
+        return LOGGER_ERROR("no searchable [a-z0-9]+ terms in query: %s", expr), -1;
+    }
+
+    struct vmbuf seqs = VMBUF_INITIALIZER, result = VMBUF_INITIALIZER, acc = VMBUF_INITIALIZER;
+    struct vmbuf dec = VMBUF_INITIALIZER, tmp = VMBUF_INITIALIZER;
+    vmbuf_init(&seqs, 4096);
+    vmbuf_init(&result, 4096);
+    vmbuf_init(&acc, 4096);
+    vmbuf_init(&dec, 4096);
+    vmbuf_init(&tmp, 4096);
+
+    ssize_t matches = 0;
+    if (0 > distil_list_numbered(dir, ".terms", &seqs))
+        matches = -1;
+
+    size_t i, n = vmbuf_wlocpos(&seqs) / sizeof(uint32_t);
+    for (i = 0; i < n && 0 <= matches; ++i) {
+        struct distil_index_segment seg;
+        if (0 > distil_index_segment_open(&seg, dir, ((uint32_t *)vmbuf_data(&seqs))[i]))
+            continue;
+        if (seg.header->max_ts >= from && seg.header->min_ts <= to) {
+            ssize_t res = query_segment(&seg, qterms, num_terms, num_groups, from, to, &result, &acc, &dec, &tmp, cb, arg);
+            matches = 0 > res ? -1 : matches + res;
+        }
+        distil_index_segment_close(&seg);
+    }
+
+    vmbuf_free(&seqs);
+    vmbuf_free(&result);
+    vmbuf_free(&acc);
+    vmbuf_free(&dec);
+    vmbuf_free(&tmp);
+    free(query);
+    return matches;
+}
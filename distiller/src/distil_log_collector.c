@@ -1,17 +1,264 @@
 #include "distil_log_collector.h"
+#include "distil_record.h"
+#include "distil_index.h"
+#include "distil_columnar.h"
+#include "distil_anomaly.h"
+
+#include <sys/stat.h>
+#include <time.h>
+#include <signal.h>
+
+#define DISTIL_WATCH_MAX_SOURCES 64
+#define DISTIL_WATCH_BATCH 4096   /* records taken from a source before moving to the next */
+#define DISTIL_WATCH_IDLE_MS 250
 
 extern struct distiller_config ds_conf;
 
+static volatile sig_atomic_t stop_requested = 0;
+
+static const char *column_names[DISTIL_COL_MAX] = { "ts", "host", "file", "level", "template", "message" };
+
+struct export_columns {
+    int cols[DISTIL_COL_MAX];
+    int num_cols;
+};
+
+static void
+print_match (const struct distil_index_segment *seg, uint32_t doc, void *arg) {
+    UNUSED(arg);
+    size_t len;
+    const char *data = distil_index_segment_doc(seg, doc, &len);
+    fwrite(data, 1, len, stdout);
+    fputc('\n', stdout);
+}
+
+/* TSV, one row per line: tabs and newlines inside values are flattened */
+static void
+print_row (const struct distil_columnar_row *row, void *arg) {
+    const struct export_columns *ec = (const struct export_columns *)arg;
+    int i;
+    for (i = 0; i < ec->num_cols; ++i) {
+        if (0 < i)
+            fputc('\t', stdout);
+        int col = ec->cols[i];
+        if (DISTIL_COL_TS == col) {
+            printf("%llu", (unsigned long long)row->ts);
+            continue;
+        }
+        const char *p = row->val[col], *end = p + row->len[col];
+        for (; p < end; ++p)
+            fputc((*p == '\t' || *p == '\n' || *p == '\r') ? ' ' : *p, stdout);
+    }
+    fputc('\n', stdout);
+}
+
+static int
+parse_export_columns (char *names, struct export_columns *ec, uint32_t *mask) {
+    char *name;
+    ec->num_cols = 0;
+    *mask = 0;
+    while (NULL != (name = strsep(&names, ","))) {
+        int col;
+        for (col = 0; col < DISTIL_COL_MAX && 0 != strcmp(name, column_names[col]); ++col);
+        if (DISTIL_COL_MAX == col || DISTIL_COL_MAX == ec->num_cols)
+            return LOGGER_ERROR("unknown column: %s", name), -1;
+        ec->cols[ec->num_cols++] = col;
+        *mask |= DISTIL_COL_MASK(col);
+    }
+    return 0;
+}
+
+static const char *anomaly_kinds[] = { "spike", "cleared", "late" };
+
+static void
+print_anomaly (const struct distil_anomaly_event *ev, void *arg) {
+    UNUSED(arg);
+    if (DISTIL_ANOMALY_LATE == ev->kind)
+        printf("%llu\t%.*s\t%s\trecords=%u\n",
+               (unsigned long long)ev->ts, (int)ev->source_len, ev->source, anomaly_kinds[ev->kind], ev->count);
+    else
+        printf("%llu\t%.*s\t%s\tneg=%u\tmean=%.2f\tsd=%.2f\tz=%.1f\twindow=%u/%u\n",
+               (unsigned long long)ev->ts, (int)ev->source_len, ev->source, anomaly_kinds[ev->kind],
+               ev->count, ev->mean, ev->sd, ev->z, ev->window_neg, ev->window_total);
+    fflush(stdout);
+}
+
+static uint64_t
+monotonic_ms (void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void
+request_stop (int signum) {
+    UNUSED(signum);
+    stop_requested = 1;
+}
+
+/* follows the sources until SIGTERM/SIGINT (0) or an error (-1) */
+static int
+watch (char *sources, double threshold, bool from_start) {
+    struct distil_reader readers[DISTIL_WATCH_MAX_SOURCES];
+    size_t num_readers = 0, i;
+    char *source;
+    while (NULL != (source = strsep(&sources, ","))) {
+        if (SSTRISEMPTY(source))
+            continue;
+        if (DISTIL_WATCH_MAX_SOURCES == num_readers)
+            return LOGGER_ERROR("watching more than %d sources is not supported", DISTIL_WATCH_MAX_SOURCES), -1;
+        if (0 > distil_reader_follow(&readers[num_readers], source, from_start))
+            return -1;
+        ++num_readers;
+    }
+
+    struct distil_anomaly_detector det;
+    if (0 > distil_anomaly_init(&det, threshold, print_anomaly, NULL))
+        return -1;
+
+    // no SA_RESTART: a sleep is cut short and the loop winds down
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = request_stop;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+
+    uint64_t last_tick = monotonic_ms();
+    int res = 0;
+    while (0 <= res && !stop_requested) {
+        size_t got = 0;
+        uint64_t now = monotonic_ms();
+        for (i = 0; i < num_readers && 0 <= res; ++i) {
+            struct distil_record rec;
+            size_t n = 0;
+            while (n < DISTIL_WATCH_BATCH && 0 < (res = distil_reader_next(&readers[i], &rec))) {
+                distil_anomaly_add(&det, &rec, now);
+                ++n;
+            }
+            got += n;
+        }
+        // quiet sources get their buckets closed as time passes
+        if (now - last_tick >= DISTIL_WATCH_IDLE_MS) {
+            distil_anomaly_tick(&det, now);
+            last_tick = now;
+        }
+        if (0 == got && !stop_requested)
+            usleep(DISTIL_WATCH_IDLE_MS * 1000);
+    }
+    if (0 <= res) {
+        LOGGER_INFO("%s", "stopping");
+        distil_anomaly_flush(&det);
+    }
+    LOGGER_INFO("%zu late records over the run", det.late);
+    fflush(stdout);
+
+    for (i = 0; i < num_readers; ++i)
+        distil_reader_close(&readers[i]);
+    distil_anomaly_free(&det);
+    return 0 <= res ? 0 : -1;
+}
+
+static int
+collect (char *sources, struct distil_index_writer *iw, struct distil_columnar_writer *cw) {
+    char *source;
+    while (NULL != (source = strsep(&sources, ","))) {
+        if (SSTRISEMPTY(source))
+            continue;
+        struct distil_reader reader;
+        if (0 > distil_reader_open(&reader, source))
+            return -1;
+
+        struct distil_record rec;
+        size_t num_records = 0;
+        int res;
+        while (0 < (res = distil_reader_next(&reader, &rec))) {
+            if (0 > distil_index_writer_add(iw, &rec) || 0 > distil_columnar_writer_add(cw, &rec))
+                break;
+            ++num_records;
+        }
+        distil_reader_close(&reader);
+        LOGGER_INFO("%s: %zu records", source, num_records);
+        if (0 != res)
+            return -1;
+    }
+    return 0;
+}
+
 int main (int argc, char* argv[]) {
 
     init_distiller_config(argc, argv);
+    if (ds_conf.watch) {
+        if (SSTRISEMPTY(ds_conf.file_source)) {
+            LOGGER_ERROR("%s", "watch mode requires a file data-source");
+            exit (EXIT_FAILURE);
+        }
+        if (0 > watch(ds_conf.file_source, 0 < ds_conf.threshold ? ds_conf.threshold : DISTIL_ANOMALY_THRESHOLD, ds_conf.from_start))
+            exit (EXIT_FAILURE);
+        exit (EXIT_SUCCESS);
+    }
+
+    if (SSTRISEMPTY(ds_conf.data_dir)) {
+        LOGGER_ERROR("%s", "data directory is required");
+        exit (EXIT_FAILURE);
+    }
+    char *index_dir = ribs_malloc_sprintf("%s/index", ds_conf.data_dir);
+    char *columnar_dir = ribs_malloc_sprintf("%s/columnar", ds_conf.data_dir);
+
+    if (NULL != ds_conf.export_columns) {
+        struct export_columns ec;
+        uint32_t mask;
+        if (0 > parse_export_columns(ds_conf.export_columns, &ec, &mask))
+            exit (EXIT_FAILURE);
+        struct distil_columnar_query q;
+        memset(&q, 0, sizeof(q));
+        q.from = ds_conf.from;
+        q.to = ds_conf.to;
+        q.equals[DISTIL_COL_HOST] = ds_conf.host;
+        q.equals[DISTIL_COL_FILE] = ds_conf.source_file;
+        q.equals[DISTIL_COL_LEVEL] = ds_conf.level;
+        ssize_t rows = distil_columnar_scan(columnar_dir, &q, mask, print_row, &ec);
+        if (0 > rows)
+            exit (EXIT_FAILURE);
+        fflush(stdout);
+        LOGGER_INFO("%zd rows", rows);
+        return 0;
+    }
+
+    if (NULL != ds_conf.query) {
+        ssize_t matches = distil_index_query(index_dir, ds_conf.query, ds_conf.from, ds_conf.to, print_match, NULL);
+        if (0 > matches)
+            exit (EXIT_FAILURE);
+        fflush(stdout);
+        LOGGER_INFO("%zd matches", matches);
+        return 0;
+    }
+
     if (SSTRISEMPTY(ds_conf.file_source) && SSTRISEMPTY(ds_conf.nw_source->hostname)) {
         LOGGER_ERROR("%s", "requires either of two input sources");
         exit (EXIT_FAILURE);
     }
+    if (SSTRISEMPTY(ds_conf.file_source)) {
+        LOGGER_ERROR("%s", "network data-source is not supported yet, use a file data-source");
+        exit (EXIT_FAILURE);
+    }
+
+    if (0 > mkdir(ds_conf.data_dir, 0755) && EEXIST != errno) {
+        LOGGER_PERROR("cannot create %s", ds_conf.data_dir);
+        exit (EXIT_FAILURE);
+    }
+
+    struct distil_index_writer iw;
+    struct distil_columnar_writer cw;
+    if (0 > distil_index_writer_init(&iw, index_dir) || 0 > distil_columnar_writer_init(&cw, columnar_dir))
+        exit (EXIT_FAILURE);
+    int res = collect(ds_conf.file_source, &iw, &cw);
+    if (0 > distil_index_writer_close(&iw))
+        res = -1;
+    if (0 > distil_columnar_writer_close(&cw))
+        res = -1;
+    if (0 > res)
+        exit (EXIT_FAILURE);
 
-    
-    
     return 0;
 }
-    
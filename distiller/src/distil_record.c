@@ -0,0 +1,470 @@
+#include "distil_record.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <libgen.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#define DISTIL_READ_CHUNK (1024 * 1024)
+#define DISTIL_TAIL_SCAN (64 * 1024) /* how far back from the end a followed file's last line is looked for */
+#define DISTIL_HEAD_SCAN 96    /* timestamp and level are expected this early in a message */
+
+static const char *levels[] = { "FATAL", "ERROR", "WARN", "INFO", "DEBUG", "TRACE" };
+
+
+static int
+digits (const char *p, int n) {
+    int v = 0;
+    for (; n > 0; --n, ++p) {
+        if (*p < '0' || *p > '9')
+            return -1;
+        v = v * 10 + (*p - '0');
+    }
+    return v;
+}
+
+/* finds yyyy-mm-dd hh:mm:ss[,mmm] near the start of the message, as elasticsearch logs it */
+static bool
+parse_ts (const char *p, const char *end, uint64_t *ts) {
+    const char *lim = (end - p > DISTIL_HEAD_SCAN) ? p + DISTIL_HEAD_SCAN : end;
+    for (; p + 19 <= lim; ++p) {
+        if (p[4] != '-' || p[7] != '-' || (p[10] != ' ' && p[10] != 'T') || p[13] != ':' || p[16] != ':')
+            continue;
+        struct tm tm;
+        memset(&tm, 0, sizeof(tm));
+        tm.tm_year = digits(p, 4) - 1900;
+        tm.tm_mon = digits(p + 5, 2) - 1;
+        tm.tm_mday = digits(p + 8, 2);
+        tm.tm_hour = digits(p + 11, 2);
+        tm.tm_min = digits(p + 14, 2);
+        tm.tm_sec = digits(p + 17, 2);
+        if (0 > tm.tm_year || 0 > tm.tm_mon || 0 > tm.tm_mday || 0 > tm.tm_hour || 0 > tm.tm_min || 0 > tm.tm_sec)
+            continue;
+        int ms = 0;
+        if (p + 23 <= end && (p[19] == ',' || p[19] == '.') && 0 > (ms = digits(p + 20, 3)))
+            ms = 0;
+        *ts = (uint64_t)timegm(&tm) * 1000 + ms;
+        return true;
+    }
+    return false;
+}
+
+static void
+parse_level (struct distil_record *rec) {
+    size_t scan = rec->message_len < DISTIL_HEAD_SCAN ? rec->message_len : DISTIL_HEAD_SCAN;
+    const char *best = NULL;
+    size_t i;
+    for (i = 0; i < sizeof(levels) / sizeof(levels[0]); ++i) {
+        const char *l = memmem(rec->message, scan, levels[i], strlen(levels[i]));
+        if (l && (!best || l < best)) {
+            best = l;
+            rec->level_len = strlen(levels[i]);
+        }
+    }
+    rec->level = best ? best : "";
+    if (!best)
+        rec->level_len = 0;
+}
+
+static int
+hexval (char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+/* { "message": "..." } -> unescaped message, in place. returns its length, 0 if there is none */
+static size_t
+unwrap_json_message (char *line, size_t len) {
+    char *end = line + len;
+    char *p = memmem(line, len, "\"message\"", 9);
+    if (NULL == p)
+        return 0;
+    p += 9;
+    while (p < end && (*p == ' ' || *p == ':'))
+        ++p;
+    if (p == end || *p != '"')
+        return 0;
+    ++p;
+
+    char *out = line;
+    while (p < end && *p != '"') {
+        if (*p != '\\' || p + 1 == end) {
+            *out++ = *p++;
+            continue;
+        }
+        ++p;
+        switch (*p) {
+        case 'n': *out++ = '\n'; break;
+        case 't': *out++ = '\t'; break;
+        case 'r': *out++ = '\r'; break;
+        case 'b': *out++ = '\b'; break;
+        case 'f': *out++ = '\f'; break;
+        case 'u':
+            if (p + 4 < end) {
+                int c = (hexval(p[1]) << 12) | (hexval(p[2]) << 8) | (hexval(p[3]) << 4) | hexval(p[4]);
+                *out++ = (0 <= c && c < 0x80) ? (char)c : '?';
+                p += 4;
+            }
+            break;
+        default: *out++ = *p; break;
+        }
+        ++p;
+    }
+    return out - line;
+}
+
+static void
+set_message (struct distil_record *rec, const char *message, size_t len, uint64_t default_ts) {
+    rec->message = message;
+    rec->message_len = len;
+    if (!parse_ts(message, message + len, &rec->ts))
+        rec->ts = default_ts;
+    parse_level(rec);
+}
+
+/* next line of the chunk being handed out, with the chunk's host|file. 0 once there is none */
+static int
+next_chunk_line (struct distil_reader *reader, struct distil_record *rec) {
+    while (reader->rest < reader->rest_end) {
+        const char *p = reader->rest;
+        const char *nl = memchr(p, '\n', reader->rest_end - p);
+        size_t len = (nl ? nl : reader->rest_end) - p;
+        reader->rest = nl ? nl + 1 : reader->rest_end;
+        if (0 < len && p[len - 1] == '\r')
+            --len;
+        if (0 == len)
+            continue;
+
+        vmbuf_reset(&reader->line);
+        vmbuf_memcpy(&reader->line, reader->host, reader->host_len);
+        vmbuf_chrcpy(&reader->line, '|');
+        vmbuf_memcpy(&reader->line, reader->file, reader->file_len);
+        vmbuf_chrcpy(&reader->line, '|');
+        vmbuf_memcpy(&reader->line, p, len);
+
+        const char *raw = vmbuf_data(&reader->line);
+        rec->raw = raw;
+        rec->raw_len = vmbuf_wlocpos(&reader->line);
+        rec->host = raw;
+        rec->host_len = reader->host_len;
+        rec->file = raw + reader->host_len + 1;
+        rec->file_len = reader->file_len;
+        set_message(rec, rec->file + reader->file_len + 1, len, reader->default_ts);
+        return 1;
+    }
+    return 0;
+}
+
+int
+distil_record_parse (char *line, size_t len, uint64_t default_ts, struct distil_record *rec) {
+    if (0 < len && line[len - 1] == '\r')
+        --len;
+    if (0 < len && line[0] == '{' && 0 == (len = unwrap_json_message(line, len)))
+        return -1;
+    // trailing newline of the original line, shipped as part of the message
+    while (0 < len && line[len - 1] == '\n')
+        --len;
+
+    char *end = line + len;
+    char *p1 = memchr(line, '|', len);
+    if (NULL == p1)
+        return -1;
+    char *p2 = memchr(p1 + 1, '|', end - p1 - 1);
+    if (NULL == p2)
+        return -1;
+
+    rec->raw = line;
+    rec->raw_len = len;
+    rec->host = line;
+    rec->host_len = p1 - line;
+    rec->file = p1 + 1;
+    rec->file_len = p2 - p1 - 1;
+    set_message(rec, p2 + 1, end - p2 - 1, default_ts);
+    return 0;
+}
+
+int
+distil_reader_open (struct distil_reader *reader, const char *filename) {
+    memset(reader, 0, sizeof(*reader));
+    reader->fd = -1;
+    reader->gz = gzopen(filename, "rb"); // reads plain files as well
+    if (NULL == reader->gz)
+        return LOGGER_PERROR("cannot open %s", filename), -1;
+    gzbuffer(reader->gz, DISTIL_READ_CHUNK);
+    vmbuf_init(&reader->buf, DISTIL_READ_CHUNK * 2);
+    vmbuf_init(&reader->line, 4096);
+    reader->default_ts = (uint64_t)time(NULL) * 1000;
+    return 0;
+}
+
+/* where following from the end starts: after the last complete line, or the end of a gzip file */
+static off_t
+tail_offset (int fd, off_t size) {
+    char buf[DISTIL_TAIL_SCAN];
+    off_t from = size > DISTIL_TAIL_SCAN ? size - DISTIL_TAIL_SCAN : 0;
+    unsigned char magic[2];
+    if (2 == pread(fd, magic, 2, 0) && 0x1f == magic[0] && 0x8b == magic[1])
+        return size;
+    ssize_t res = pread(fd, buf, size - from, from);
+    if (0 >= res)
+        return size;
+    const char *nl = memrchr(buf, '\n', res);
+    if (NULL != nl)
+        return from + (nl - buf) + 1;
+    return 0 == from ? 0 : size;
+}
+
+/* swaps the file being read for fd. what is buffered stays, to be read first */
+static int
+reader_attach_fd (struct distil_reader *reader, int fd, bool at_end) {
+    struct stat st;
+    if (0 > fstat(fd, &st) || (at_end && 0 > lseek(fd, tail_offset(fd, st.st_size), SEEK_SET))) {
+        close(fd);
+        return -1;
+    }
+    gzFile gz = gzdopen(fd, "rb"); // reads plain files as well
+    if (NULL == gz) {
+        close(fd);
+        return -1;
+    }
+    gzbuffer(gz, DISTIL_READ_CHUNK);
+    if (NULL != reader->gz)
+        gzclose(reader->gz);
+    reader->gz = gz;
+    reader->fd = fd;
+    reader->dev = st.st_dev;
+    reader->ino = st.st_ino;
+    reader->draining = false;
+    return 0;
+}
+
+static int
+reader_attach (struct distil_reader *reader, const char *filename, bool at_end) {
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (0 > fd)
+        return -1;
+    return reader_attach_fd(reader, fd, at_end);
+}
+
+/* [.]<base>.<epoch>.<seq>[.gz|.tmp], the way logzilla names --target segments. seq, 0 if name isn't one */
+static uint64_t
+segment_seq (const char *name, const char *base) {
+    size_t blen = strlen(base);
+    bool tmp = '.' == *name && 0 == strncmp(name + 1, base, blen);
+    if (tmp)
+        ++name;
+    if (0 != strncmp(name, base, blen) || '.' != name[blen] || !isdigit((unsigned char)name[blen + 1]))
+        return 0;
+    char *end;
+    strtol(name + blen + 1, &end, 10);
+    if ('.' != *end || !isdigit((unsigned char)end[1]))
+        return 0;
+    uint64_t seq = strtoull(end + 1, &end, 10);
+    if (tmp ? 0 != strcmp(end, ".tmp") : ('\0' != *end && 0 != strcmp(end, ".gz")))
+        return 0;
+    return seq;
+}
+
+/* the first segment after seq, or the newest one. 1: found, 0: none yet, -1: error */
+static int
+segment_find (struct distil_reader *reader, uint64_t after, bool newest, char *name, size_t size, uint64_t *seq) {
+    DIR *dir = opendir(reader->seg_dir);
+    if (NULL == dir)
+        return LOGGER_PERROR("cannot list %s", reader->seg_dir), -1;
+    uint64_t found = 0;
+    struct dirent *de;
+    while (NULL != (de = readdir(dir))) {
+        uint64_t s = segment_seq(de->d_name, reader->seg_base);
+        if (s <= after || (0 < found && (newest ? s < found : s > found)))
+            continue;
+        found = s;
+        snprintf(name, size, "%s/%s", reader->seg_dir, de->d_name);
+    }
+    closedir(dir);
+    *seq = found;
+    return 0 < found;
+}
+
+/* what to read once the current file is drained. 1: found, 0: none yet, -1: error */
+static int
+follow_successor (struct distil_reader *reader, char *name, size_t size, uint64_t *seq) {
+    if (NULL != reader->seg_dir)
+        return segment_find(reader, reader->seq, false, name, size, seq);
+    struct stat st;
+    if (0 > stat(reader->path, &st))
+        return 0; // moved away, not recreated yet
+    if (NULL != reader->gz && st.st_dev == reader->dev && st.st_ino == reader->ino)
+        return 0;
+    snprintf(name, size, "%s", reader->path);
+    return 1;
+}
+
+/* at the end of a followed file. 1: go on reading, 0: nothing new, -1: error */
+static int
+follow_rotate (struct distil_reader *reader) {
+    char name[PATH_MAX];
+    uint64_t seq = reader->seq;
+    struct stat st;
+    if (NULL != reader->gz && 0 == fstat(reader->fd, &st) && st.st_size < lseek(reader->fd, 0, SEEK_CUR)) {
+        // truncated in place: what is there now is new
+        LOGGER_INFO("%s was truncated, reading it from the start", reader->path);
+        if (0 < vmbuf_ravail(&reader->buf))
+            vmbuf_chrcpy(&reader->buf, '\n');
+        int fd = -1;
+        if (0 > lseek(reader->fd, 0, SEEK_SET) || 0 > (fd = dup(reader->fd)) || 0 > reader_attach_fd(reader, fd, false))
+            return LOGGER_PERROR("cannot reopen %s", reader->path), -1;
+        return 1;
+    }
+
+    int res = follow_successor(reader, name, sizeof(name), &seq);
+    if (0 >= res)
+        return res;
+    // the old file may have got its last write in after the read that came up empty
+    if (NULL != reader->gz && !reader->draining) {
+        reader->draining = true;
+        return 1;
+    }
+    // a last line without a newline is complete now
+    if (0 < vmbuf_ravail(&reader->buf))
+        vmbuf_chrcpy(&reader->buf, '\n');
+    if (0 > reader_attach(reader, name, false)) {
+        if (ENOENT == errno)
+            return 0; // renamed while we looked, next time
+        return LOGGER_PERROR("cannot open %s", name), -1;
+    }
+    reader->seq = seq;
+    LOGGER_INFO("following %s", name);
+    return 1;
+}
+
+int
+distil_reader_follow (struct distil_reader *reader, const char *path, bool from_start) {
+    memset(reader, 0, sizeof(*reader));
+    reader->fd = -1;
+    reader->follow = true;
+    reader->path = strdup(path);
+    vmbuf_init(&reader->buf, DISTIL_READ_CHUNK * 2);
+    vmbuf_init(&reader->line, 4096);
+    reader->default_ts = (uint64_t)time(NULL) * 1000;
+
+    struct stat st;
+    if (0 == stat(path, &st)) {
+        if (0 > reader_attach(reader, path, !from_start))
+            return LOGGER_PERROR("cannot open %s", path), -1;
+        return 0;
+    }
+    if (ENOENT != errno)
+        return LOGGER_PERROR("cannot open %s", path), -1;
+
+    char *dir = strdup(path), *base = strdup(path);
+    reader->seg_dir = strdup(dirname(dir));
+    reader->seg_base = strdup(basename(base));
+    free(dir);
+    free(base);
+    LOGGER_INFO("%s doesn't exist, following it as a logzilla target", path);
+
+    char name[PATH_MAX];
+    int res = segment_find(reader, 0, !from_start, name, sizeof(name), &reader->seq);
+    if (0 > res)
+        return -1;
+    if (0 < res && 0 > reader_attach(reader, name, !from_start))
+        reader->seq = 0; // gone before we got to it, picked up on the first read
+    return 0;
+}
+
+/* 1: got a record, 0: end of input, -1: read error. malformed lines are skipped */
+int
+distil_reader_next (struct distil_reader *reader, struct distil_record *rec) {
+    while (1) {
+        // continuation lines without a timestamp of their own belong to the previous record
+        if (0 < next_chunk_line(reader, rec)) {
+            reader->default_ts = rec->ts;
+            return 1;
+        }
+
+        char *start = vmbuf_rloc(&reader->buf);
+        size_t avail = vmbuf_ravail(&reader->buf);
+        char *nl = memchr(start, '\n', avail);
+        if (NULL != nl || (reader->eof && 0 < avail)) {
+            size_t len = nl ? (size_t)(nl - start) : avail;
+            vmbuf_rseek(&reader->buf, nl ? len + 1 : len);
+            if (0 > distil_record_parse(start, len, reader->default_ts, rec))
+                continue;
+            const char *nl = memchr(rec->message, '\n', rec->message_len);
+            if (NULL != nl) {
+                // a shipped chunk: this is its first line, the rest follow on the next calls
+                reader->host = rec->host;
+                reader->host_len = rec->host_len;
+                reader->file = rec->file;
+                reader->file_len = rec->file_len;
+                reader->rest = nl + 1;
+                reader->rest_end = rec->message + rec->message_len;
+                size_t first_len = nl - rec->message;
+                if (0 < first_len && rec->message[first_len - 1] == '\r')
+                    --first_len;
+                set_message(rec, rec->message, first_len, reader->default_ts);
+                rec->raw_len = (rec->message + first_len) - rec->raw;
+            }
+            reader->default_ts = rec->ts;
+            return 1;
+        }
+        if (reader->eof)
+            return 0;
+
+        // keep the partial line, drop what was consumed
+        memmove(vmbuf_data(&reader->buf), start, avail);
+        vmbuf_reset(&reader->buf);
+        vmbuf_wseek(&reader->buf, avail);
+        vmbuf_resize_if_less(&reader->buf, DISTIL_READ_CHUNK);
+
+        if (NULL == reader->gz) {
+            // a target with no segments yet
+            int res = follow_rotate(reader);
+            if (0 >= res)
+                return res;
+            continue;
+        }
+        int res = gzread(reader->gz, vmbuf_wloc(&reader->buf), DISTIL_READ_CHUNK);
+        if (0 > res) {
+            int errnum;
+            return LOGGER_ERROR("read error: %s", gzerror(reader->gz, &errnum)), -1;
+        }
+        if (0 == res) {
+            if (reader->follow) {
+                // the partial line stays buffered until the rest shows up
+                gzclearerr(reader->gz);
+                res = follow_rotate(reader);
+                if (0 >= res)
+                    return res;
+                continue;
+            }
+            reader->eof = true;
+        } else {
+            vmbuf_wseek(&reader->buf, res);
+            reader->draining = false;
+        }
+    }
+}
+
+void
+distil_reader_close (struct distil_reader *reader) {
+    if (NULL != reader->gz)
+        gzclose(reader->gz);
+    reader->gz = NULL;
+    vmbuf_free(&reader->buf);
+    vmbuf_free(&reader->line);
+    free(reader->path);
+    free(reader->seg_dir);
+    free(reader->seg_base);
+    reader->path = reader->seg_dir = reader->seg_base = NULL;
+}
@@ -0,0 +1,50 @@
+#include "distil_utils.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <dirent.h>
+
+
+int
+distil_write_fully (int fd, const void *data, size_t size) {
+    const char *p = (const char *)data;
+    while (0 < size) {
+        ssize_t res = write(fd, p, size);
+        if (0 > res) {
+            if (EINTR == errno)
+                continue;
+            return -1;
+        }
+        p += res;
+        size -= res;
+    }
+    return 0;
+}
+
+int
+distil_cmp_u32 (const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+int
+distil_list_numbered (const char *dir, const char *suffix, struct vmbuf *out) {
+    vmbuf_reset(out);
+    DIR *d = opendir(dir);
+    if (NULL == d)
+        return ENOENT == errno ? 0 : (LOGGER_PERROR("cannot list %s", dir), -1);
+    struct dirent *de;
+    while (NULL != (de = readdir(d))) {
+        char *end;
+        unsigned long n = strtoul(de->d_name, &end, 10);
+        if (end != de->d_name && 0 == strcmp(end, suffix)) {
+            uint32_t v = n;
+            vmbuf_memcpy(out, &v, sizeof(v));
+        }
+    }
+    closedir(d);
+    qsort(vmbuf_data(out), vmbuf_wlocpos(out) / sizeof(uint32_t), sizeof(uint32_t), distil_cmp_u32);
+    return 0;
+}
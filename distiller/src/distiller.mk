@@ -1,8 +1,8 @@
 TARGET=distiller
 
-SRC=distil_log_collector.c
+SRC=distil_log_collector.c distil_record.c distil_dict.c distil_index.c distil_columnar.c distil_anomaly.c distil_utils.c
 
 CFLAGS+= -I ../../ribs2/include -I ../../logzilla/include -I ../include -I .
-LDFLAGS+=-L -pthread -lz -ldl -L../../ribs2/lib -lribs2 -lrt
+LDFLAGS+=-L -pthread -lz -lm -ldl -L../../ribs2/lib -lribs2 -lrt
 
 include ../../ribs2/make/ribs.mk
@@ -11,13 +11,20 @@
 
 #include "logz_struct_defs.h"
 
-#define LOGDAEMON_INITIALIZER {NULL, NULL, NULL, NULL}
+#define LOGDAEMON_INITIALIZER {NULL, NULL, 0, NULL, 0, NULL, NULL, 0, 0, 0, 0}
 
 struct logdaemon_config {
     char *watch_files;
-    char *exclude_files;
+    char **exclude_like;   /* [file=]literal[,literal...] per option */
+    size_t num_exclude_like;
+    char **include_like;
+    size_t num_include_like;
     char *target;
     char *interface;
+    size_t mem_limit;      /* bytes. 0: unbounded */
+    size_t rotate_size;    /* bytes. 0: never */
+    time_t rotate_interval; /* seconds. 0: never */
+    int compress_level;    /* gzip level for target segments. 0: plain */
 };
 
 void
@@ -26,31 +33,51 @@ usage(char *arg0) {
 
     printf("usage: \n");
     printf("       %*c  [-f|--files] required(files to watch) supports comma delimited names \n", (int)strlen(arg0), ' ');
-    printf("       %*c  [-E|--exclude-like] optional(exclude such files) | not implemented \n", (int)strlen(arg0), ' ');
-    printf("       %*c  [-t|--target]  optional(create/append-write to this target file)\n", (int)strlen(arg0), ' ');
+    printf("       %*c  [-E|--exclude-like] optional(drop lines containing any of these comma delimited literals. file= prefix limits them to that file. repeatable)\n", (int)strlen(arg0), ' ');
+    printf("       %*c  [-I|--include-like] optional(ship only lines containing one of these comma delimited literals. file= prefix as above. repeatable)\n", (int)strlen(arg0), ' ');
+    printf("       %*c  [-t|--target]  optional(write rotating segments <target>.<epoch>.<seq> to this path, listed in <target>.index with first/last write time in ms)\n", (int)strlen(arg0), ' ');
+    printf("       %*c  [-R|--rotate-size]  optional(start a new target segment after this many MB)\n", (int)strlen(arg0), ' ');
+    printf("       %*c  [-T|--rotate-time]  optional(start a new target segment after this many seconds)\n", (int)strlen(arg0), ' ');
+    printf("       %*c  [-z|--compress]  optional(gzip target segments at this level, 1-9)\n", (int)strlen(arg0), ' ');
     printf("       %*c  [-s|--write-to]  optional(receive collated data on this HTTP interface. logs to target otherwise. One of them is required)\n", (int)strlen(arg0), ' ');
+    printf("       %*c  [-m|--mem-limit]  optional(memory ceiling in MB for buffered data: partial lines and unwritten segment data. reads pause while above it)\n", (int)strlen(arg0), ' ');
     printf("       %*c  [--help] prints this help\n", (int)strlen(arg0), ' ');
     printf("\n");
 
     exit(EXIT_FAILURE);
 }
 
+static void
+add_line_rule (char ***rules, size_t *num_rules, const char *spec) {
+    char **r = (char **)realloc(*rules, (*num_rules + 1) * sizeof(char *));
+    if (NULL == r) {
+        perror("add_line_rule");
+        exit(EXIT_FAILURE);
+    }
+    r[(*num_rules)++] = strdup(spec);
+    *rules = r;
+}
 
 static inline int
 init_log_config (struct logdaemon_config *config, int argc, char *argv[]) {
 
     static struct option longopts[] = {
         {"files", 1, 0, 'f'},
-        {"exclude-like", 2, 0, 'E'},
+        {"exclude-like", 1, 0, 'E'},
+        {"include-like", 1, 0, 'I'},
         {"target", 2, 0, 't'},
         {"write-to", 2, 0, 's'},
+        {"mem-limit", 1, 0, 'm'},
+        {"rotate-size", 1, 0, 'R'},
+        {"rotate-time", 1, 0, 'T'},
+        {"compress", 1, 0, 'z'},
         {"help", 0, 0, 1},
         {0, 0, 0, 0}
     };
 
     while (1) {
         int option_index = 0;
-        int c = getopt_long(argc, argv, "f:t:s:E::", longopts, &option_index);
+        int c = getopt_long(argc, argv, "f:t:s:E:I:m:R:T:z:", longopts, &option_index);
         if (c == -1)
             break;
         switch (c) {
@@ -61,11 +88,28 @@ init_log_config (struct logdaemon_config *config, int argc, char *argv[]) {
             config->target = strdup(optarg);
             break;
         case 'E':
-            config->exclude_files = strdup(optarg);
+            add_line_rule(&config->exclude_like, &config->num_exclude_like, optarg);
+            break;
+        case 'I':
+            add_line_rule(&config->include_like, &config->num_include_like, optarg);
             break;
         case 's':
             config->interface = strdup(optarg);
             break;
+        case 'm':
+            config->mem_limit = strtoul(optarg, NULL, 10) << 20;
+            break;
+        case 'R':
+            config->rotate_size = strtoul(optarg, NULL, 10) << 20;
+            break;
+        case 'T':
+            config->rotate_interval = strtol(optarg, NULL, 10);
+            break;
+        case 'z':
+            config->compress_level = atoi(optarg);
+            if (config->compress_level < 0 || config->compress_level > 9)
+                usage(argv[0]);
+            break;
         default:
             usage(argv[0]);
             break;
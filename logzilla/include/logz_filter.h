@@ -0,0 +1,47 @@
+#ifndef _LOGZ_FILTER_H_
+#define _LOGZ_FILTER_H_
+
+#include "ribs.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#define LOGZ_FILTER_INCLUDE 0x1
+#define LOGZ_FILTER_EXCLUDE 0x2
+
+/*
+ * line filter: include and exclude literals compiled into one aho-corasick
+ * automaton. the automaton is a full transition table (256 entries per
+ * state), so a line costs one table lookup per byte no matter how many
+ * literals there are. a line is dropped if it contains any exclude literal,
+ * or if there are include literals and it contains none of them.
+ *
+ * while no literal is partially matched, the scan skips straight to the next
+ * byte that can start one (memchr when all literals share the first byte).
+ */
+struct logz_filter {
+    struct vmbuf delta;       /* uint32 next state, 256 per state. 0 while building: no edge */
+    struct vmbuf out;         /* uint8 LOGZ_FILTER_* per state, including those reached via failure links */
+    uint32_t num_states;
+    uint8_t kinds;            /* LOGZ_FILTER_* of all literals added */
+    bool compiled;
+    int num_first;            /* distinct first bytes */
+    uint8_t first;            /* the first byte, when there is only one */
+    bool start[256];
+    size_t dropped;           /* lines dropped so far */
+};
+
+int logz_filter_init(struct logz_filter *filter);
+int logz_filter_add(struct logz_filter *filter, const char *literal, size_t len, int kind);
+int logz_filter_compile(struct logz_filter *filter);
+bool logz_filter_keep(struct logz_filter *filter, const char *line, size_t len);
+size_t logz_filter_apply(struct logz_filter *filter, char *data, size_t len);
+void logz_filter_free(struct logz_filter *filter);
+
+static inline bool
+logz_filter_empty (const struct logz_filter *filter) {
+    return 0 == filter->kinds;
+}
+
+#endif /* _LOGZ_FILTER_H_ */
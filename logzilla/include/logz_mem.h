@@ -0,0 +1,110 @@
+#ifndef _LOGZ_MEM_H_
+#define _LOGZ_MEM_H_
+
+#include "ribs.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+/*
+ * arena: ribs memalloc with usage accounting. allocations are never freed
+ * individually, the whole arena is reset once its owner is done (end of a
+ * flush pass). memalloc keeps its first block across resets, so a warmed up
+ * arena serves subsequent passes without going back to malloc.
+ */
+struct logz_arena {
+    struct memalloc ma;
+    size_t used;
+};
+
+#define LOGZ_ARENA_INITIALIZER { MEMALLOC_INITIALIZER, 0 }
+
+static inline void *
+logz_arena_alloc (struct logz_arena *arena, size_t size) {
+    void *mem = memalloc_alloc(&arena->ma, size);
+    if (NULL != mem)
+        arena->used += size;
+    return mem;
+}
+
+static inline char *
+logz_arena_strndup (struct logz_arena *arena, const char *str, size_t len) {
+    char *mem = (char *)logz_arena_alloc(arena, len + 1);
+    if (NULL == mem)
+        return NULL;
+    memcpy(mem, str, len);
+    mem[len] = '\0';
+    return mem;
+}
+
+static inline char *
+logz_arena_strdup (struct logz_arena *arena, const char *str) {
+    return logz_arena_strndup(arena, str, strlen(str));
+}
+
+static inline void
+logz_arena_reset (struct logz_arena *arena) {
+    if (0 == arena->used)
+        return;
+    memalloc_reset(&arena->ma);
+    arena->used = 0;
+}
+
+static inline void
+logz_arena_free (struct logz_arena *arena) {
+    memalloc_free(&arena->ma);
+    arena->used = 0;
+}
+
+
+/*
+ * pool: fixed number of fixed-size slots, carved out once at startup.
+ * slots are handed out from a free stack, so get/put never allocate and
+ * pointers stay valid for the life of the pool.
+ */
+struct logz_pool {
+    char *slots;
+    size_t slot_size;
+    size_t capacity;
+    void **free_slots;
+    size_t num_free;
+};
+
+static inline int
+logz_pool_init (struct logz_pool *pool, size_t slot_size, size_t capacity) {
+    pool->slots = (char *)calloc(capacity, slot_size);
+    pool->free_slots = (void **)calloc(capacity, sizeof(void *));
+    if (NULL == pool->slots || NULL == pool->free_slots)
+        return LOGGER_ERROR("%s", "pool: out of memory"), -1;
+    pool->slot_size = slot_size;
+    pool->capacity = capacity;
+    pool->num_free = 0;
+    size_t i;
+    for (i = capacity; i > 0; --i)
+        pool->free_slots[pool->num_free++] = pool->slots + (i - 1) * slot_size;
+    return 0;
+}
+
+static inline void *
+logz_pool_get (struct logz_pool *pool) {
+    if (0 == pool->num_free)
+        return NULL;
+    void *slot = pool->free_slots[--pool->num_free];
+    memset(slot, 0, pool->slot_size);
+    return slot;
+}
+
+static inline void
+logz_pool_put (struct logz_pool *pool, void *slot) {
+    if (NULL == slot || pool->num_free == pool->capacity)
+        return;
+    pool->free_slots[pool->num_free++] = slot;
+}
+
+static inline void *
+logz_pool_slot (struct logz_pool *pool, size_t index) {
+    return index < pool->capacity ? pool->slots + index * pool->slot_size : NULL;
+}
+
+#endif /* _LOGZ_MEM_H_ */
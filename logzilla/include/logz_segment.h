@@ -0,0 +1,74 @@
+#ifndef _LOGZ_SEGMENT_H_
+#define _LOGZ_SEGMENT_H_
+
+#include "ribs.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <limits.h>
+#include <zlib.h>
+
+#define LOGZ_SEGMENT_BLOCK_SIZE (1024 * 1024)
+#define LOGZ_SEGMENT_MAX_PENDING (8 * LOGZ_SEGMENT_BLOCK_SIZE)
+
+/*
+ * rotating file sink for --target.
+ *
+ * records are coalesced into blocks of LOGZ_SEGMENT_BLOCK_SIZE and written
+ * out a block at a time into a hidden temp file next to the target,
+ * .<target>.<epoch>.<seq>.tmp. idle ticks push the partial tail out too;
+ * plain segments then fill that block up first, so writes stay on block
+ * boundaries, and a compressed tail waits until it's worth a gzip member of
+ * its own (64KB) or has waited a few seconds. once a segment grows past
+ * max_size or gets older than max_age it is closed and renamed to
+ * <target>.<epoch>.<seq>[.gz], so anything matching that pattern is complete. each finished segment gets
+ * a line in <target>.index:
+ *
+ *     <segment>\t<first ms>\t<last ms>\t<records>\t<bytes>\n
+ *
+ * first/last are the times the first and last record were handed to the
+ * writer, not timestamps from the records themselves.
+ *
+ * temp names are unique and never reused. temp segments left behind by a
+ * crash or a failed rename are published on the next start, and seq carries
+ * on from the highest one found.
+ */
+struct logz_segment_writer {
+    char *target;
+    size_t max_size;          /* rotate after this many raw bytes. 0: never */
+    time_t max_age;           /* rotate after this many seconds. 0: never */
+    int compress_level;       /* gzip level. 0: plain */
+
+    char *dir;
+    char *base;               /* target's basename */
+    int fd;
+    int index_fd;
+    char tmp_name[PATH_MAX];
+    char final_name[PATH_MAX];
+    uint64_t seq;
+    time_t opened;
+    off_t written;            /* last good offset in the open segment */
+    size_t raw_bytes;
+    size_t records;
+    uint64_t first_ts, last_ts; /* ms since epoch */
+
+    struct vmbuf block;       /* coalesced raw records, not yet written */
+    time_t pending_since;     /* when the oldest of those came in */
+    struct vmbuf zbuf;        /* deflate output */
+    z_stream zs;
+};
+
+int logz_segment_writer_init(struct logz_segment_writer *sw, const char *target, size_t max_size, time_t max_age, int compress_level);
+int logz_segment_writer_write(struct logz_segment_writer *sw, const char *data, size_t size);
+int logz_segment_writer_tick(struct logz_segment_writer *sw);
+int logz_segment_writer_close(struct logz_segment_writer *sw);
+
+/* records buffered but not written yet, past the one block being filled: that much is always held */
+static inline size_t
+logz_segment_writer_mem_usage (struct logz_segment_writer *sw) {
+    size_t pending = vmbuf_wlocpos(&sw->block);
+    return (LOGZ_SEGMENT_BLOCK_SIZE < pending ? pending - LOGZ_SEGMENT_BLOCK_SIZE : 0) + vmbuf_wlocpos(&sw->zbuf);
+}
+
+#endif /* _LOGZ_SEGMENT_H_ */
@@ -4,8 +4,13 @@
 #include <stdbool.h>
 #include <libgen.h>
 #include <sys/stat.h>
+#include <limits.h>
+#include <signal.h>
 #include "http_client_pool.h"
 #include "logz_utils.h"
+#include "logz_mem.h"
+#include "logz_segment.h"
+#include "logz_filter.h"
 #include "uri_encode.h"
 #include "json.h"
 
@@ -20,7 +25,12 @@ static char *hostname = NULL;
 struct server eserv;
 
 #define MAX_FILE_SUPPORT 10
+#define LOGZ_READ_CHUNK ((BUFSIZ + 1024) &~ 1024)
+#define LOGZ_MAX_FRINGE (1024 * 1024) /* partial line carried over; shipped as is beyond this */
+#define LOGZ_WRITE_BUFFER_KEEP (64 * 1024) /* write_buffer is shrunk back after records bigger than this */
 #define HTTP_CLIENT_TIMEOUT 60000
+#define LOGZ_EVENT_BUF (64 * (sizeof(struct inotify_event) + NAME_MAX + 1))
+#define LOGZ_EVENT_MAX_BATCH (1024 * 1024) /* events drained before the dirty files are serviced */
 
 struct http_client_pool client_pool = {
     .timeout_handler.timeout = HTTP_CLIENT_TIMEOUT,
@@ -38,6 +48,10 @@ struct logz_file_def {
     int wd;                /* inotify internal */
     int parent_wd;         /* on parent directory inotify internal */
     size_t basename_start; /* basename offs in filename  */
+    bool pending;          /* needs a read: modified since the last flush, or paused under memory pressure */
+    struct vmbuf fringe;   /* trailing partial line, carried to the next read */
+    struct logz_arena arena; /* per-file scratch: the fringe+head composite, reset once it's shipped */
+    struct logz_filter *filter; /* line rules for this file */
 };
 
 static const uint32_t inotify_file_watch_mask = (IN_MODIFY | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF);
@@ -47,11 +61,16 @@ static const uint32_t inotify_file_watch_mask = (IN_MODIFY | IN_ATTRIB | IN_DELE
 int success = 0, failure = 0;
 
 struct thashtable *tab_event_fds;
-struct thashtable *delta_push;
+static struct logz_pool filedef_pool;
+static bool mem_paused = false;
+static volatile sig_atomic_t stop_requested = 0;
 
 struct vmbuf write_buffer = VMBUF_INITIALIZER;
+struct vmbuf read_buffer = VMBUF_INITIALIZER;
 struct vmbuf mb = VMBUF_INITIALIZER;
-static struct file_writer fw;
+static struct logz_segment_writer segw;
+static struct logz_filter line_filters[MAX_FILE_SUPPORT];
+static size_t num_line_filters = 0;
 
 
 static int
@@ -69,9 +88,18 @@ mtime_to_spec (const struct stat *st) {
     return time;
 }
 
+static void
+request_stop (int signum) {
+    UNUSED(signum);
+    stop_requested = 1;
+}
+
 void
 dump_stats () {
-    LOGGER_INFO("stats since alive:: success:%d | failures:%d", success, failure);
+    size_t dropped = 0, i;
+    for (i = 0; i < num_line_filters; ++i)
+        dropped += line_filters[i].dropped;
+    LOGGER_INFO("stats since alive:: success:%d | failures:%d | filtered lines:%zu", success, failure, dropped);
 }
 
 
@@ -81,6 +109,116 @@ logz_close_fd (int fd, const char *filename) {
         LOGGER_ERROR("failed to close file:%s (%d)", filename, fd);
 }
 
+/*
+ * data held in memory: carried over fringes, composites in use and records the
+ * segment writer hasn't written yet. the fixed working buffers (one read
+ * chunk, one escaped record, one segment block) are not counted, nothing
+ * can release them and they never hold data across passes.
+ */
+static size_t
+logz_mem_usage (void) {
+    size_t usage = 0;
+    if (write_to_file)
+        usage += logz_segment_writer_mem_usage(&segw);
+    size_t i;
+    for (i = 0; i < filedef_pool.capacity; ++i) {
+        struct logz_file_def *filedef = logz_pool_slot(&filedef_pool, i);
+        usage += vmbuf_wlocpos(&filedef->fringe) + filedef->arena.used;
+    }
+    return usage;
+}
+
+/* drop whatever isn't holding data right now: idle fringes and arenas */
+static void
+logz_mem_reclaim (void) {
+    size_t i;
+    for (i = 0; i < filedef_pool.capacity; ++i) {
+        struct logz_file_def *filedef = logz_pool_slot(&filedef_pool, i);
+        if (0 < filedef->fringe.capacity && 0 == vmbuf_wlocpos(&filedef->fringe)) {
+            vmbuf_free(&filedef->fringe);
+            vmbuf_make(&filedef->fringe);
+        }
+        logz_arena_free(&filedef->arena);
+    }
+}
+
+static bool
+logz_mem_exhausted (void) {
+    if (0 == logconf.mem_limit)
+        return false;
+    size_t usage = logz_mem_usage();
+    if (usage >= logconf.mem_limit) {
+        logz_mem_reclaim();
+        usage = logz_mem_usage();
+    }
+    bool exhausted = usage >= logconf.mem_limit;
+    if (exhausted != mem_paused) {
+        mem_paused = exhausted;
+        if (exhausted)
+            LOGGER_INFO("memory ceiling reached (%zu of %zu bytes), pausing reads", usage, logconf.mem_limit);
+        else
+            LOGGER_INFO("memory back under the ceiling (%zu of %zu bytes), resuming reads", usage, logconf.mem_limit);
+    }
+    return exhausted;
+}
+
+/* [file=]literal,... -> index of the file the rule is limited to, -1 if it applies to all. *literals is set past the prefix */
+static int
+line_rule_scope (const char *spec, char **files, size_t num_files, const char **literals) {
+    const char *sep = strchr(spec, '=');
+    *literals = spec;
+    if (NULL == sep)
+        return -1;
+    size_t len = sep - spec;
+    size_t i;
+    for (i = 0; i < num_files; ++i) {
+        const char *base = strrchr(files[i], '/');
+        base = base ? base + 1 : files[i];
+        if ((len == strlen(files[i]) && 0 == strncmp(spec, files[i], len))
+            || (len == strlen(base) && 0 == strncmp(spec, base, len))) {
+            *literals = sep + 1;
+            return i;
+        }
+    }
+    return -1; // '=' is part of a literal
+}
+
+static int
+add_line_rules (struct logz_filter *filter, size_t file, char **rules, size_t num_rules, int kind, char **files, size_t num_files) {
+    size_t i;
+    for (i = 0; i < num_rules; ++i) {
+        const char *literals;
+        int scope = line_rule_scope(rules[i], files, num_files, &literals);
+        if (-1 != scope && (size_t)scope != file)
+            continue;
+        while (*literals) {
+            const char *comma = strchrnul(literals, ',');
+            if (0 > logz_filter_add(filter, literals, comma - literals, kind))
+                return -1;
+            literals = *comma ? comma + 1 : comma;
+        }
+    }
+    return 0;
+}
+
+/* one automaton per watched file: rules for all files plus its own */
+static int
+init_line_filters (char **files, size_t num_files) {
+    size_t i;
+    for (i = 0; i < num_files; ++i) {
+        struct logz_filter *filter = &line_filters[i];
+        logz_filter_init(filter);
+        ++num_line_filters;
+        if (0 > add_line_rules(filter, i, logconf.exclude_like, logconf.num_exclude_like, LOGZ_FILTER_EXCLUDE, files, num_files)
+            || 0 > add_line_rules(filter, i, logconf.include_like, logconf.num_include_like, LOGZ_FILTER_INCLUDE, files, num_files)
+            || 0 > logz_filter_compile(filter))
+            return LOGGER_ERROR("cannot compile line rules for %s", files[i]), -1;
+        if (!logz_filter_empty(filter))
+            LOGGER_INFO("%s: %u filter states", files[i], filter->num_states);
+    }
+    return 0;
+}
+
 static int
 http_client_pool_post_request2(
     struct http_client_pool *http_client_pool,
@@ -123,7 +261,7 @@ post_to_interface (char *data, size_t data_len) {
 }
 
 static void
-write_out_stream (const char *filename, char *data) {
+_write_out_stream (const char *filename, char *data) {
     vmbuf_reset(&write_buffer);
     vmbuf_sprintf(&write_buffer, "{ \"message\": \"%s|%s|", hostname, filename);
     json_escape_str_vmb(&write_buffer, data);
@@ -131,10 +269,13 @@ write_out_stream (const char *filename, char *data) {
     vmbuf_chrcpy(&write_buffer, '\0');
 
     if (write_to_file) {
-        if (0 > file_writer_write(&fw, vmbuf_data(&write_buffer), vmbuf_wlocpos(&write_buffer))) {
-            LOGGER_ERROR("%s", "failed write attempt on outfile| aborting to diagnose!");
-            abort();
+        // one record per line on disk, the terminator stays out
+        if (0 > logz_segment_writer_write(&segw, vmbuf_data(&write_buffer), vmbuf_wlocpos(&write_buffer) - 1)) {
+            ++failure;
+            LOGGER_ERROR("failed write attempt on %s", logconf.target);
+            return;
         }
+        ++success;
         return;
     }
 
@@ -148,83 +289,117 @@ write_out_stream (const char *filename, char *data) {
     }
 }
 
+/* a runaway record grew the escape buffer, don't keep that around */
+static void
+write_out_stream (const char *filename, char *data) {
+    _write_out_stream(filename, data);
+    if (LOGZ_WRITE_BUFFER_KEEP < write_buffer.capacity) {
+        vmbuf_free(&write_buffer);
+        vmbuf_init(&write_buffer, 4096);
+    }
+}
+
+
+static void
+write_file_fringe (const char *filename, struct logz_file_def *filedef) {
+    if (0 == vmbuf_wlocpos(&filedef->fringe))
+        return;
+    vmbuf_chrcpy(&filedef->fringe, '\0');
+    if (logz_filter_keep(filedef->filter, vmbuf_data(&filedef->fringe), vmbuf_wlocpos(&filedef->fringe) - 1))
+        write_out_stream(filename, vmbuf_data(&filedef->fringe));
+    vmbuf_reset(&filedef->fringe);
+}
+
+static void
+carry_file_fringe (const char *filename, struct logz_file_def *filedef, const char *data, size_t len) {
+    if (0 == len)
+        return;
+    if (LOGZ_MAX_FRINGE < vmbuf_wlocpos(&filedef->fringe) + len)
+        write_file_fringe(filename, filedef); // runaway line. ship what we have
+    if (0 == filedef->fringe.capacity)
+        vmbuf_init(&filedef->fringe, 4096);
+    vmbuf_memcpy(&filedef->fringe, data, len);
+}
 
+/* joins the carried over fringe with the first line of data. returns the rest of data */
 static char *
-write_file_fringe (const char *filename, char *data, int fd) {
-    thashtable_rec_t *rec = thashtable_lookup(delta_push, &fd, sizeof(fd));
-    struct vmbuf delta = *(struct vmbuf *)thashtable_get_val(rec);
-    char *past = vmbuf_data(&delta);
-    char *lookahead = NULL;
-
-    if (!SSTRISEMPTY(past)) {
-        lookahead = strchr(data, '\n');
-        char *trailing_past = ribs_malloc_sprintf("%.*s", ((int)strlen(data) - (int)strlen(lookahead)), data);
-        if (trailing_past) {
-            char *d_composite = ribs_malloc_sprintf("%s%s", past, trailing_past);
-            write_out_stream(filename, d_composite);
-            d_composite += strlen(d_composite); // advance by that
-            vmbuf_reset(&delta);
-        }
+join_file_fringe (const char *filename, struct logz_file_def *filedef, char *data) {
+    char *lookahead = strchr(data, '\n');
+    size_t head_len = lookahead ? (size_t)(lookahead - data) : strlen(data);
+    size_t past_len = vmbuf_wlocpos(&filedef->fringe);
+
+    char *d_composite = (char *)logz_arena_alloc(&filedef->arena, past_len + head_len + 1);
+    if (NULL == d_composite) {
+        write_file_fringe(filename, filedef);
+        return data;
     }
-    return lookahead;
+    memcpy(d_composite, vmbuf_data(&filedef->fringe), past_len);
+    memcpy(d_composite + past_len, data, head_len);
+    d_composite[past_len + head_len] = '\0';
+    if (logz_filter_keep(filedef->filter, d_composite, past_len + head_len))
+        write_out_stream(filename, d_composite);
+    vmbuf_reset(&filedef->fringe);
+    // shipped, the arena holds one composite at a time however long the read burst
+    logz_arena_reset(&filedef->arena);
+    return lookahead ? lookahead + 1 : NULL;
 }
 
+/* reads what's new. to_eof: the fd is about to go, everything is read whatever the ceiling */
 static void
-trigger_writer (
-    const char *filename,
-    struct logz_file_def *filedef) {
+trigger_writer (struct logz_file_def *filedef, bool to_eof) {
 
-    vmbuf_reset(&write_buffer);
+    const char *fn = filedef->name + filedef->basename_start;
     ssize_t res;
-    char *fn = basename(ribs_strdup(filename));
+    filedef->pending = false;
+    bool paused = false;
     while(1) {
-        vmbuf_reset(&write_buffer);
-        res = read(filedef->fd, vmbuf_wloc(&write_buffer), (BUFSIZ + 1024) &~ 1024);
-
-        filedef->size += res;
-        lseek (filedef->fd, filedef->size, SEEK_SET);
-
-        if (0 > vmbuf_wseek(&write_buffer, res)) {
-            LOGGER_ERROR("%s", "wseek error");
-            break;
-        } else if (0 > res) {
-            LOGGER_ERROR("%s", "read error"); // EAGAIN is handled by poller
+        if (paused) {
+            filedef->pending = true;
             break;
-        } else if (0 < res) {
-            // initial sanitizer
-            vmbuf_chrcpy(&write_buffer, '\0'); // kill garbage
-            char *data = ribs_strdup(vmbuf_data(&write_buffer));
-            //data = strchr(data, '\n') + 1; // skip broken data from initial buffer start. we read from where the file was first observed
-            ssize_t write_depth = res = strlen(data);
-            // line doesn't end here
-            if (data[res - 1] != '\n') {
-                char *datafringe = ribs_strdup((char *)memrchr(data, '\n', res));
-                if (SSTRISEMPTY(datafringe))
-                    break;
-                write_depth = strlen(data) - strlen(datafringe);
-                *(data + write_depth) = 0;
-
-                if (filedef->size != 0) {
-                    char *rebalanced_data = write_file_fringe(fn, data, filedef->fd);
-                    if (NULL != rebalanced_data) {
-                        data = rebalanced_data;
-                        write_depth = strlen(data);
-                    }
-                }
-
-                thashtable_rec_t *rec = thashtable_lookup(delta_push, &filedef->fd, sizeof(filedef->fd));
-                struct vmbuf kdelta = *(struct vmbuf *)thashtable_get_val(rec);
-                vmbuf_strcpy(&kdelta, datafringe);
-                vmbuf_chrcpy(&kdelta, '\0');
+        }
+        if (!to_eof && logz_mem_exhausted()) {
+            // backpressure: leave the rest in the file, picked up once usage drops. a file
+            // holding a partial line still gets a chunk, that's the only way its fringe drains
+            if (0 == vmbuf_wlocpos(&filedef->fringe)) {
+                filedef->pending = true;
+                break;
             }
+            paused = true;
+        }
+        vmbuf_reset(&read_buffer);
+        vmbuf_resize_if_less(&read_buffer, LOGZ_READ_CHUNK + 1);
+        res = read(filedef->fd, vmbuf_wloc(&read_buffer), LOGZ_READ_CHUNK);
 
-            vmbuf_reset(&write_buffer);
-            vmbuf_memcpy(&write_buffer, data, write_depth);
-            vmbuf_chrcpy(&write_buffer, '\0');
-            write_out_stream(fn, ribs_strdup(vmbuf_data(&write_buffer)));
+        if (0 > res) {
+            if (EAGAIN != errno)
+                LOGGER_PERROR("read error: %s", filedef->name); // EAGAIN is handled by poller
+            break;
         } else if (0 == res) {
             break;
         }
+
+        filedef->size += res;
+        if (0 > vmbuf_wseek(&read_buffer, res)) {
+            LOGGER_ERROR("%s", "wseek error");
+            break;
+        }
+        vmbuf_chrcpy(&read_buffer, '\0'); // kill garbage
+
+        char *data = vmbuf_data(&read_buffer);
+        char *eol = (char *)memrchr(data, '\n', res);
+        if (NULL == eol) {
+            // line doesn't end here
+            carry_file_fringe(fn, filedef, data, res);
+            continue;
+        }
+        // terminate in place, everything past the last newline carries over
+        *eol = '\0';
+        if (0 < vmbuf_wlocpos(&filedef->fringe))
+            data = join_file_fringe(fn, filedef, data);
+        // noise goes before it costs escaping and shipping
+        if (NULL != data && 0 < logz_filter_apply(filedef->filter, data, eol - data))
+            write_out_stream(fn, data);
+        carry_file_fringe(fn, filedef, eol + 1, (vmbuf_data(&read_buffer) + res) - (eol + 1));
     }
 }
 
@@ -238,6 +413,7 @@ _flush (
     struct stat stats;
     char const *name = filedef->name;
 
+    filedef->pending = false;
     if (filedef->fd == -1)
         return;
 
@@ -253,6 +429,7 @@ _flush (
         *prev_wd = wd;
         lseek (filedef->fd, stats.st_size, SEEK_SET);
         filedef->size = stats.st_size;
+        vmbuf_reset(&filedef->fringe);
     } else if (S_ISREG (filedef->mode)
                && stats.st_size == filedef->size
                && timecmp (filedef->mtime, mtime_to_spec(&stats)) == 0)
@@ -262,9 +439,71 @@ _flush (
         *prev_wd = wd;
     }
 
-    trigger_writer (name, filedef);
+    filedef->mtime = mtime_to_spec(&stats);
+    trigger_writer (filedef, false);
+}
+
+/* back to the pool, with whatever it still holds */
+static void
+release_file (struct logz_file_def *filedef) {
+    logz_close_fd(filedef->fd, filedef->name);
+    filedef->fd = -1;
+    vmbuf_free(&filedef->fringe);
+    logz_arena_free(&filedef->arena);
+    logz_pool_put(&filedef_pool, filedef);
+}
+
+static void
+flush_pending (struct logz_file_def **filedef, uint32_t num_files, int *prev_wd) {
+    uint32_t i;
+    for (i = 0; i < num_files; i++) {
+        if (filedef[i]->pending)
+            _flush(filedef[i], filedef[i]->wd, prev_wd);
+    }
 }
 
+/* file showed up (again) in its directory: watch it and read the new one from the start */
+static void
+rewatch_file (int inotify_wd, struct logz_file_def *filedef) {
+    int inserted = 0;
+    int wdx = inotify_add_watch (inotify_wd, filedef->name, inotify_file_watch_mask);
+    if (0 > wdx) {
+        LOGGER_ERROR("cannot watch %s", filedef->name);
+        return;
+    }
+    if (wdx == filedef->wd)
+        return; // same file, a modify will follow
+    if (-1 != filedef->wd) {
+        // gone already if the old file was deleted, EINVAL then
+        inotify_rm_watch(inotify_wd, filedef->wd);
+        thashtable_remove(tab_event_fds, &filedef->wd, sizeof (filedef->wd));
+    }
+    filedef->wd = wdx;
+    thashtable_insert(tab_event_fds, &filedef->wd, sizeof(filedef->wd), &filedef, sizeof(filedef), &inserted);
+
+    if (-1 != filedef->fd) {
+        // whatever the old one still had, paused under the ceiling or not: it can't be read later
+        trigger_writer(filedef, true);
+        write_file_fringe(filedef->name + filedef->basename_start, filedef);
+        logz_close_fd(filedef->fd, filedef->name);
+    }
+    filedef->fd = open(filedef->name, O_RDONLY | O_NONBLOCK);
+    if (0 > filedef->fd) {
+        LOGGER_PERROR("cannot open %s to read", filedef->name);
+        return;
+    }
+    struct stat stats;
+    if (fstat (filedef->fd, &stats) != 0) {
+        filedef->errnum = errno;
+        logz_close_fd (filedef->fd, filedef->name);
+        filedef->fd = -1;
+        return;
+    }
+    filedef->size = 0;
+    filedef->mode = stats.st_mode;
+    memset(&filedef->mtime, 0, sizeof(filedef->mtime));
+    filedef->pending = true;
+}
 
 static bool
 recursive_flush_events (
@@ -272,12 +511,10 @@ recursive_flush_events (
     char **files,
     uint32_t num_files) {
 
-    struct logz_file_def *filedef = ribs_malloc(num_files * sizeof(struct logz_file_def));
+    struct logz_file_def *filedef[MAX_FILE_SUPPORT];
 
     int prev_wd;
-    size_t evlen = 0;
-    // size_t evbuf_off = 0;
-    
+
     bool found_unwatchable_dir = false;
     bool no_inotify_resources = false;
 
@@ -286,27 +523,29 @@ recursive_flush_events (
     size_t i;
     for (i = 0; i < num_files; i++) {
 
-        filedef[i].name = files[i];
-        size_t fnlen = strlen (filedef[i].name);
-        if (evlen < fnlen)
-            evlen = fnlen;
+        filedef[i] = logz_pool_get(&filedef_pool);
+        filedef[i]->fd = -1;
+        filedef[i]->name = files[i];
+        filedef[i]->filter = &line_filters[i];
 
-        filedef[i].wd = -1;
-        char *file_fullname = ribs_strdup(filedef[i].name);
+        filedef[i]->wd = -1;
+        char file_fullname[PATH_MAX];
+        snprintf(file_fullname, sizeof(file_fullname), "%s", filedef[i]->name);
         char *dir_name = dirname(file_fullname);
         size_t dirlen = strlen(dir_name);;
-        char prev = filedef[i].name[dirlen];
-        filedef[i].basename_start = basename (file_fullname) - filedef[i].name;
+        char prev = filedef[i]->name[dirlen];
+        char *slash = strrchr(filedef[i]->name, '/');
+        filedef[i]->basename_start = slash ? (size_t)(slash + 1 - filedef[i]->name) : 0;
 
-        filedef[i].name[dirlen] = '\0';
+        filedef[i]->name[dirlen] = '\0';
 
-        filedef[i].parent_wd = inotify_add_watch(inotify_wd, dir_name, (IN_CREATE | IN_MOVED_TO));
+        filedef[i]->parent_wd = inotify_add_watch(inotify_wd, dir_name, (IN_CREATE | IN_MOVED_TO));
 
-        filedef[i].name[dirlen] = prev;
+        filedef[i]->name[dirlen] = prev;
 
-        if(filedef[i].parent_wd < 0) {
+        if(filedef[i]->parent_wd < 0) {
             if (errno != ENOSPC)
-                LOGGER_ERROR("cannot watch parent directory of file %s", filedef[i].name);
+                LOGGER_ERROR("cannot watch parent directory of file %s", filedef[i]->name);
             else {
                 no_inotify_resources = true;
                 LOGGER_ERROR("%s", "inotify resources exhausted");
@@ -315,39 +554,36 @@ recursive_flush_events (
             break;
         }
 
-        filedef[i].wd = inotify_add_watch(inotify_wd, filedef[i].name, inotify_file_watch_mask);
+        filedef[i]->wd = inotify_add_watch(inotify_wd, filedef[i]->name, inotify_file_watch_mask);
 
-        if (filedef[i].wd < 0) {
+        if (filedef[i]->wd < 0) {
             if (errno == ENOSPC) {
                 no_inotify_resources = true;
                 LOGGER_ERROR("%s", "inotify resources exhausted");
-            } else if(errno != filedef[i].errnum)
-                LOGGER_ERROR("cannot watch %s", filedef[i].name);
+            } else if(errno != filedef[i]->errnum)
+                LOGGER_ERROR("cannot watch %s", filedef[i]->name);
             continue;
         }
-        filedef[i].fd = open(filedef[i].name, O_RDONLY | O_NONBLOCK);
-        if (0 >= filedef[i].fd) {
-            LOGGER_ERROR("skipping file %s. cannot open to read", filedef[i].name);
+        filedef[i]->fd = open(filedef[i]->name, O_RDONLY | O_NONBLOCK);
+        if (0 >= filedef[i]->fd) {
+            LOGGER_ERROR("skipping file %s. cannot open to read", filedef[i]->name);
             continue;
         }
 
         struct stat stats;
-        if (fstat (filedef[i].fd, &stats) != 0) {
-            LOGGER_ERROR("skipping file %s.cannot stat", filedef[i].name);
-            filedef->errnum = errno;
-            logz_close_fd (filedef[i].fd, filedef[i].name);
-            filedef->fd = -1;
+        if (fstat (filedef[i]->fd, &stats) != 0) {
+            LOGGER_ERROR("skipping file %s.cannot stat", filedef[i]->name);
+            filedef[i]->errnum = errno;
+            logz_close_fd (filedef[i]->fd, filedef[i]->name);
+            filedef[i]->fd = -1;
             continue;
         }
-        filedef[i].size = stats.st_size;
-        lseek (filedef[i].fd, 0, SEEK_END); // no offset enforced
-
-        thashtable_insert(tab_event_fds, &filedef[i].wd, sizeof(filedef[i].wd), &filedef[i], sizeof(filedef[i]), &inserted);
+        filedef[i]->size = stats.st_size;
+        filedef[i]->mode = stats.st_mode;
+        filedef[i]->mtime = mtime_to_spec(&stats);
+        lseek (filedef[i]->fd, 0, SEEK_END); // no offset enforced
 
-        struct vmbuf kdelta = VMBUF_INITIALIZER;
-        vmbuf_init(&kdelta, 4096);
-
-        thashtable_insert(delta_push, &filedef[i].fd, sizeof(filedef[i].fd), &kdelta, sizeof(kdelta), &inserted);
+        thashtable_insert(tab_event_fds, &filedef[i]->wd, sizeof(filedef[i]->wd), &filedef[i], sizeof(filedef[i]), &inserted);
     }
 
     if(no_inotify_resources || found_unwatchable_dir) {
@@ -355,98 +591,121 @@ recursive_flush_events (
         abort();
     }
 
-    prev_wd = filedef[num_files -1].wd;
+    prev_wd = filedef[num_files -1]->wd;
 
-    evlen += sizeof (struct inotify_event) + 1;
     struct vmbuf evbuf = VMBUF_INITIALIZER;
-    vmbuf_init(&evbuf, evlen);
+    vmbuf_init(&evbuf, LOGZ_EVENT_BUF);
 
-    ssize_t res = 0;
     struct timeval delay; /* how long to wait for file changes.  */
     delay.tv_sec = (time_t) 0.50;
     delay.tv_usec = 1000000 * (0.50 - delay.tv_sec);
 
     fd_set rfd;
-    FD_ZERO (&rfd);
-    FD_SET (inotify_wd, &rfd);
 
     while(1) {
+        if (stop_requested) {
+            // partial lines go out as they are, the caller finishes the open segment
+            LOGGER_INFO("%s", "stopping");
+            for (i = 0; i < num_files; i++) {
+                write_file_fringe(filedef[i]->name + filedef[i]->basename_start, filedef[i]);
+                release_file(filedef[i]);
+            }
+            vmbuf_free(&evbuf);
+            return true;
+        }
         if (thashtable_get_size(tab_event_fds) == 0) {
             LOGGER_INFO("%s", "no file to read");
+            for (i = 0; i < num_files; i++)
+                release_file(filedef[i]);
+            vmbuf_free(&evbuf);
             return true;
         }
 
-        {
-            int file_change = select(inotify_wd + 1, &rfd, NULL, NULL, NULL);
+        FD_ZERO (&rfd);
+        FD_SET (inotify_wd, &rfd);
+        struct timeval timeout = delay;
+        int file_change = select(inotify_wd + 1, &rfd, NULL, NULL, &timeout);
 
-            if (file_change == 0)
+        if (file_change == 0) {
+            // quiet period: resume files paused by the memory ceiling
+            flush_pending(filedef, num_files, &prev_wd);
+            if (write_to_file && 0 > logz_segment_writer_tick(&segw))
+                LOGGER_ERROR("failed to roll segments of %s", logconf.target);
+            continue;
+        }
+        else if (file_change == -1) {
+            if (EINTR == errno)
                 continue;
-            else if (file_change == -1) {
-                LOGGER_ERROR("%s", "error monitoring inotify event");
-                exit(EXIT_FAILURE);
-            }
-
-            vmbuf_reset(&evbuf);
+            LOGGER_ERROR("%s", "error monitoring inotify event");
+            exit(EXIT_FAILURE);
+        }
 
-            while (0 < (res = read(inotify_wd, vmbuf_wloc(&evbuf), evlen))) {
+        // drain everything queued so far, a batch of events at a time
+        vmbuf_reset(&evbuf);
+        while (vmbuf_wlocpos(&evbuf) < LOGZ_EVENT_MAX_BATCH) {
+            vmbuf_resize_if_less(&evbuf, LOGZ_EVENT_BUF);
+            ssize_t res = read(inotify_wd, vmbuf_wloc(&evbuf), LOGZ_EVENT_BUF);
+            if (0 < res) {
                 if (0 > vmbuf_wseek(&evbuf, res))
                     return false;
-                else if (errno == EINTR)
-                    continue;
-                else if (0 < res)
-                    break;
-            }
-            if (errno == EAGAIN && res < 0)
                 continue;
-            // res might be 0, or could have overrun memory
-            if (res == 0) {
-                LOGGER_ERROR("%s", "error reading inotify event|bad buffer size. aborting to investigate");
-                abort();
             }
-            // another case when res == 0 or could have overrun memory or got EINVAL
-            // -- ignored --
-            // what to do if? .. realloc buffer. but the deal is we're on vmbuf which will grow if world is that bad. we're mostly safe here. hence ignored.
+            if (0 > res && EINTR == errno)
+                continue;
+            if (0 > res && EAGAIN == errno)
+                break;
+            // 0 or EINVAL: buffer can't hold a single event, never the case with a NAME_MAX sized one
+            LOGGER_PERROR("%s", "error reading inotify event|bad buffer size. aborting to investigate");
+            abort();
         }
 
-        struct logz_file_def *tmp;
-        struct inotify_event *event = (struct inotify_event *)vmbuf_data(&evbuf);
-        if (event->len) {
-            // events of lower interest?. these are from watched directory. we'll drop those which we're not watching for and will set watch on those of interest.
-            size_t x;
-            for (x = 0; x < num_files; x++) {
-                if (filedef[x].parent_wd == event->wd
-                    && strcmp (event->name, filedef[x].name + filedef[x].basename_start))
-                    break;
-            }
-            if (x == num_files)
+        // walk every event, repeated modifies of a file collapse into its pending flag
+        char *evp = vmbuf_data(&evbuf);
+        char *evend = vmbuf_wloc(&evbuf);
+        struct inotify_event *event;
+        for (; evp < evend; evp += sizeof(struct inotify_event) + event->len) {
+            event = (struct inotify_event *)evp;
+            if (event->mask & IN_Q_OVERFLOW) {
+                // events were lost, look at everything
+                for (i = 0; i < num_files; i++)
+                    filedef[i]->pending = true;
                 continue;
-            int wdx = inotify_add_watch (inotify_wd, filedef[x].name, inotify_file_watch_mask);
-            if (0 > wdx) {
-                LOGGER_ERROR("cannot watch %s", filedef[x].name);
+            }
+
+            struct logz_file_def *tmp = NULL;
+            if (event->len) {
+                // events from watched directories. only (re)created files we're after are of interest
+                size_t x;
+                for (x = 0; x < num_files; x++) {
+                    if (filedef[x]->parent_wd == event->wd
+                        && 0 == strcmp (event->name, filedef[x]->name + filedef[x]->basename_start))
+                        break;
+                }
+                if (x < num_files)
+                    rewatch_file(inotify_wd, filedef[x]);
                 continue;
             }
-            tmp = &(filedef[x]);
-            thashtable_remove(tab_event_fds, &tmp->wd, sizeof (tmp->wd));
-            tmp->wd = wdx;
-            thashtable_insert(tab_event_fds, &tmp->wd, sizeof(tmp->wd), &tmp, sizeof(struct logz_file_def), &inserted);
-            // rebalance new found file | make all assertions | we'll read from this as well.
-            UNUSED(tmp);
-        } else {
+
             thashtable_rec_t *rec = thashtable_lookup(tab_event_fds, &event->wd, sizeof(event->wd));
-            tmp = (struct logz_file_def *)thashtable_get_val(rec);
-        }
-        if (!tmp) {
-            continue;
-        }
+            tmp = rec ? *(struct logz_file_def **)thashtable_get_val(rec) : NULL;
+            if (!tmp)
+                continue;
 
-        if (event->mask & (IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF)) {
             if (event->mask & IN_DELETE_SELF) {
+                // read what's left through the open fd, a new file gets picked up from the parent's events
                 inotify_rm_watch(inotify_wd, tmp->wd);
                 thashtable_remove(tab_event_fds, &tmp->wd, sizeof(tmp->wd));
+                tmp->wd = -1;
+                tmp->pending = true;
+                continue;
             }
-            continue;
+            if (event->mask & (IN_ATTRIB | IN_MOVE_SELF))
+                continue;
+            tmp->pending = true;
         }
-        _flush(tmp, event->wd, &prev_wd);
+
+        // one pass over the dirty set: a single fstat and read burst per file, however many events it had
+        flush_pending(filedef, num_files, &prev_wd);
     }
     return true;
 }
@@ -471,6 +730,10 @@ int main(int argc, char *argv[]) {
         while (f != NULL) {
             char *fprime = strsep(&f, ",");
             if (fprime != NULL) {
+                if (num_files == MAX_FILE_SUPPORT) {
+                    LOGGER_ERROR("watching more than %d files is not supported", MAX_FILE_SUPPORT);
+                    exit(EXIT_FAILURE);
+                }
                 files[num_files] = strdup(fprime);
                 ++num_files;
             }
@@ -480,6 +743,9 @@ int main(int argc, char *argv[]) {
         exit(EXIT_FAILURE);
     }
 
+    if (0 > init_line_filters(files, num_files))
+        exit(EXIT_FAILURE);
+
     if (0 > epoll_worker_init()) {
         LOGGER_ERROR("%s", "epoll_worker_init");
         exit(EXIT_FAILURE);
@@ -488,16 +754,16 @@ int main(int argc, char *argv[]) {
     ribs_timer(60*1000, dump_stats);
 
     tab_event_fds = thashtable_create();
-    delta_push    = thashtable_create();
     vmbuf_init(&write_buffer, 4096);
+    vmbuf_init(&read_buffer, LOGZ_READ_CHUNK + 1);
+    if (0 > logz_pool_init(&filedef_pool, sizeof(struct logz_file_def), MAX_FILE_SUPPORT))
+        exit(EXIT_FAILURE);
     vmbuf_init(&mb, 4096);
 
 
     if (SSTRISEMPTY(logconf.interface) && !SSTRISEMPTY(logconf.target)) {
-        file_writer_make(&fw);
-
-        if (0 > file_writer_init(&fw, logconf.target)) {
-            LOGGER_ERROR("%s", "flie_writer");
+        if (0 > logz_segment_writer_init(&segw, logconf.target, logconf.rotate_size, logconf.rotate_interval, logconf.compress_level)) {
+            LOGGER_ERROR("%s", "segment writer");
             exit(EXIT_FAILURE);
         }
         write_to_file = true;
@@ -534,6 +800,14 @@ int main(int argc, char *argv[]) {
     gethostname(_hostname, 1024);
     hostname = ribs_strdup(_hostname);
 
+    // no SA_RESTART: select returns and the event loop winds down
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = request_stop;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+
     int wd = inotify_init1(IN_NONBLOCK);
     if (0 >= wd) {
         LOGGER_ERROR("%s", "failed to init inotify. cannot proceed. make sure you've inotify and is accessible to this user.");
@@ -545,5 +819,8 @@ int main(int argc, char *argv[]) {
         abort();
     }
 
+    if (write_to_file)
+        logz_segment_writer_close(&segw);
+
     return 0;
 }
@@ -0,0 +1,176 @@
+#include "logz_filter.h"
+
+#include <string.h>
+#include <stdlib.h>
+
+#define LOGZ_FILTER_ROOT 0
+
+
+static inline uint32_t *
+filter_row (struct logz_filter *filter, uint32_t state) {
+    return (uint32_t *)vmbuf_data(&filter->delta) + (size_t)state * 256;
+}
+
+static uint32_t
+filter_new_state (struct logz_filter *filter) {
+    vmbuf_resize_if_less(&filter->delta, 256 * sizeof(uint32_t));
+    memset(vmbuf_wloc(&filter->delta), 0, 256 * sizeof(uint32_t));
+    vmbuf_wseek(&filter->delta, 256 * sizeof(uint32_t));
+    vmbuf_chrcpy(&filter->out, 0);
+    return filter->num_states++;
+}
+
+int
+logz_filter_init (struct logz_filter *filter) {
+    memset(filter, 0, sizeof(*filter));
+    vmbuf_init(&filter->delta, 64 * 256 * sizeof(uint32_t));
+    vmbuf_init(&filter->out, 64);
+    filter_new_state(filter); // root
+    return 0;
+}
+
+int
+logz_filter_add (struct logz_filter *filter, const char *literal, size_t len, int kind) {
+    if (filter->compiled)
+        return LOGGER_ERROR("%s", "filter already compiled"), -1;
+    if (0 == len)
+        return 0;
+
+    uint32_t state = LOGZ_FILTER_ROOT;
+    size_t i;
+    for (i = 0; i < len; ++i) {
+        uint8_t c = (uint8_t)literal[i];
+        uint32_t next = filter_row(filter, state)[c];
+        if (LOGZ_FILTER_ROOT == next) {
+            next = filter_new_state(filter);
+            filter_row(filter, state)[c] = next; // row may have moved
+        }
+        state = next;
+    }
+    ((uint8_t *)vmbuf_data(&filter->out))[state] |= kind;
+    filter->kinds |= kind;
+    return 0;
+}
+
+/* turns the trie into a dfa: missing edges follow failure links, outputs merge along them */
+int
+logz_filter_compile (struct logz_filter *filter) {
+    uint32_t *fail = (uint32_t *)calloc(filter->num_states, sizeof(uint32_t));
+    uint32_t *queue = (uint32_t *)calloc(filter->num_states, sizeof(uint32_t));
+    if (NULL == fail || NULL == queue) {
+        free(fail);
+        free(queue);
+        return LOGGER_PERROR("%s", "filter compile"), -1;
+    }
+    uint8_t *out = (uint8_t *)vmbuf_data(&filter->out);
+    uint32_t head = 0, tail = 0;
+
+    uint32_t *root = filter_row(filter, LOGZ_FILTER_ROOT);
+    int c;
+    for (c = 0; c < 256; ++c) {
+        if (LOGZ_FILTER_ROOT == root[c])
+            continue;
+        filter->start[c] = true;
+        filter->first = c;
+        ++filter->num_first;
+        queue[tail++] = root[c];
+    }
+
+    // breadth first, so a failure target's row is final before it is copied from
+    while (head < tail) {
+        uint32_t state = queue[head++];
+        uint32_t *row = filter_row(filter, state);
+        uint32_t *fail_row = filter_row(filter, fail[state]);
+        for (c = 0; c < 256; ++c) {
+            uint32_t next = row[c];
+            if (LOGZ_FILTER_ROOT == next) {
+                row[c] = fail_row[c];
+                continue;
+            }
+            fail[next] = fail_row[c];
+            out[next] |= out[fail[next]];
+            queue[tail++] = next;
+        }
+    }
+    free(fail);
+    free(queue);
+    filter->compiled = true;
+    return 0;
+}
+
+bool
+logz_filter_keep (struct logz_filter *filter, const char *line, size_t len) {
+    if (logz_filter_empty(filter))
+        return true;
+
+    const uint32_t *delta = (const uint32_t *)vmbuf_data(&filter->delta);
+    const uint8_t *out = (const uint8_t *)vmbuf_data(&filter->out);
+    const uint8_t *p = (const uint8_t *)line;
+    const uint8_t *end = p + len;
+    bool include_only = !(filter->kinds & LOGZ_FILTER_EXCLUDE);
+    uint32_t state = LOGZ_FILTER_ROOT;
+    uint8_t seen = 0;
+
+    while (p < end) {
+        if (LOGZ_FILTER_ROOT == state) {
+            // nothing in flight: skip to where a literal can start
+            if (1 == filter->num_first) {
+                p = (const uint8_t *)memchr(p, filter->first, end - p);
+                if (NULL == p)
+                    break;
+            } else {
+                while (p < end && !filter->start[*p])
+                    ++p;
+                if (p == end)
+                    break;
+            }
+        }
+        state = delta[(size_t)state * 256 + *p++];
+        seen |= out[state];
+        if (seen & LOGZ_FILTER_EXCLUDE)
+            break;
+        if ((seen & LOGZ_FILTER_INCLUDE) && include_only)
+            break;
+    }
+
+    if ((seen & LOGZ_FILTER_EXCLUDE) || ((filter->kinds & LOGZ_FILTER_INCLUDE) && !(seen & LOGZ_FILTER_INCLUDE))) {
+        ++filter->dropped;
+        return false;
+    }
+    return true;
+}
+
+/* drops filtered lines of a newline separated chunk in place. returns the new length, data stays NUL terminated */
+size_t
+logz_filter_apply (struct logz_filter *filter, char *data, size_t len) {
+    if (logz_filter_empty(filter))
+        return len;
+
+    char *end = data + len;
+    char *dst = data;
+    char *p = data;
+    while (p < end) {
+        char *nl = (char *)memchr(p, '\n', end - p);
+        char *eol = nl ? nl + 1 : end;
+        if (logz_filter_keep(filter, p, (nl ? nl : end) - p)) {
+            if (dst != p)
+                memmove(dst, p, eol - p);
+            dst += eol - p;
+        }
+        p = eol;
+    }
+    // a kept line followed by dropped ones brings its separator along
+    if (dst < end && dst > data && dst[-1] == '\n')
+        --dst;
+    *dst = '\0';
+    return dst - data;
+}
+
+void
+logz_filter_free (struct logz_filter *filter) {
+    vmbuf_free(&filter->delta);
+    vmbuf_free(&filter->out);
+    filter->num_states = 0;
+    filter->kinds = 0;
+    filter->compiled = false;
+}
@@ -0,0 +1,381 @@
+#include "logz_segment.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <libgen.h>
+#include <limits.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#define LOGZ_SEGMENT_OPEN_RETRIES 16
+#define LOGZ_SEGMENT_MIN_MEMBER (64 * 1024) /* smallest gzip member a tick writes ... */
+#define LOGZ_SEGMENT_MEMBER_AGE 5           /* ... unless its oldest record waited this many seconds */
+
+
+static uint64_t
+now_ms (void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int
+write_fully (int fd, const char *data, size_t size) {
+    while (0 < size) {
+        ssize_t res = write(fd, data, size);
+        if (0 > res) {
+            if (EINTR == errno)
+                continue;
+            return -1;
+        }
+        data += res;
+        size -= res;
+    }
+    return 0;
+}
+
+/* [.]<base>.<epoch>.<seq><suffix>, the leading '.' for temp segments. 0 if name is one */
+static int
+segment_name_parse (const char *name, const char *base, bool tmp, long *epoch, uint64_t *seq, const char **suffix) {
+    size_t blen = strlen(base);
+    if (tmp && '.' != *name++)
+        return -1;
+    if (0 != strncmp(name, base, blen) || '.' != name[blen] || !isdigit((unsigned char)name[blen + 1]))
+        return -1;
+    char *end;
+    *epoch = strtol(name + blen + 1, &end, 10);
+    if ('.' != *end || !isdigit((unsigned char)end[1]))
+        return -1;
+    *seq = strtoull(end + 1, &end, 10);
+    *suffix = end;
+    return 0;
+}
+
+static void
+segment_index (struct logz_segment_writer *sw, const char *name, uint64_t first_ts, uint64_t last_ts, size_t records, size_t bytes) {
+    char index_line[PATH_MAX + 128];
+    int len = snprintf(index_line, sizeof(index_line), "%s\t%llu\t%llu\t%zu\t%zu\n", name,
+                       (unsigned long long)first_ts, (unsigned long long)last_ts, records, bytes);
+    if (0 > write_fully(sw->index_fd, index_line, len))
+        LOGGER_PERROR("cannot index segment %s", name);
+}
+
+/* publishes a temp segment left behind by an earlier run. it may end in a partial record */
+static void
+segment_recover (struct logz_segment_writer *sw, const char *name, long epoch, uint64_t seq) {
+    char tmp_name[PATH_MAX], final_name[PATH_MAX];
+    snprintf(tmp_name, sizeof(tmp_name), "%s/%s", sw->dir, name);
+    struct stat st;
+    if (0 > stat(tmp_name, &st))
+        return;
+    if (0 == st.st_size) {
+        unlink(tmp_name);
+        return;
+    }
+
+    // gzread reads plain files as is, and tells which one it was
+    gzFile gz = gzopen(tmp_name, "rb");
+    if (NULL == gz) {
+        LOGGER_PERROR("cannot open %s", tmp_name);
+        return;
+    }
+    char buf[16 * 1024];
+    size_t records = 0, bytes = 0;
+    int res;
+    while (0 < (res = gzread(gz, buf, sizeof(buf)))) {
+        const char *p = buf, *end = buf + res;
+        while (NULL != (p = memchr(p, '\n', end - p))) {
+            ++records;
+            ++p;
+        }
+        bytes += res;
+    }
+    bool compressed = !gzdirect(gz);
+    gzclose(gz);
+
+    snprintf(final_name, sizeof(final_name), "%s.%ld.%llu%s", sw->target, epoch,
+             (unsigned long long)seq, compressed ? ".gz" : "");
+    if (0 == access(final_name, F_OK) || 0 > rename(tmp_name, final_name)) {
+        LOGGER_ERROR("cannot recover segment %s as %s", tmp_name, final_name);
+        return;
+    }
+    segment_index(sw, final_name, (uint64_t)epoch * 1000,
+                  (uint64_t)st.st_mtim.tv_sec * 1000 + st.st_mtim.tv_nsec / 1000000, records, bytes);
+    LOGGER_INFO("recovered segment %s: %zu records", final_name, records);
+}
+
+/* picks seq up where earlier runs left it, publishing their leftovers */
+static int
+segment_scan (struct logz_segment_writer *sw) {
+    DIR *dir = opendir(sw->dir);
+    if (NULL == dir)
+        return LOGGER_PERROR("cannot list %s", sw->dir), -1;
+    struct dirent *de;
+    while (NULL != (de = readdir(dir))) {
+        long epoch;
+        uint64_t seq;
+        const char *suffix;
+        if (0 == segment_name_parse(de->d_name, sw->base, false, &epoch, &seq, &suffix)
+            && ('\0' == *suffix || 0 == strcmp(suffix, ".gz"))) {
+            if (seq > sw->seq)
+                sw->seq = seq;
+        } else if (0 == segment_name_parse(de->d_name, sw->base, true, &epoch, &seq, &suffix)
+                   && 0 == strcmp(suffix, ".tmp")) {
+            if (seq > sw->seq)
+                sw->seq = seq;
+            segment_recover(sw, de->d_name, epoch, seq);
+        }
+    }
+    closedir(dir);
+    return 0;
+}
+
+static int
+segment_open (struct logz_segment_writer *sw) {
+    sw->opened = time(NULL);
+    int retries;
+    for (retries = 0; retries < LOGZ_SEGMENT_OPEN_RETRIES; ++retries) {
+        ++sw->seq;
+        snprintf(sw->tmp_name, sizeof(sw->tmp_name), "%s/.%s.%ld.%llu.tmp", sw->dir, sw->base,
+                 (long)sw->opened, (unsigned long long)sw->seq);
+        sw->fd = open(sw->tmp_name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (0 <= sw->fd || EEXIST != errno)
+            break;
+    }
+    if (0 > sw->fd)
+        return LOGGER_PERROR("cannot open segment %s", sw->tmp_name), -1;
+    snprintf(sw->final_name, sizeof(sw->final_name), "%s.%ld.%llu%s", sw->target, (long)sw->opened,
+             (unsigned long long)sw->seq, sw->compress_level ? ".gz" : "");
+    sw->written = 0;
+    sw->raw_bytes = 0;
+    sw->records = 0;
+    sw->first_ts = sw->last_ts = 0;
+    return 0;
+}
+
+/* every drained block becomes a complete gzip member; concatenated members are a valid .gz */
+static int
+segment_deflate (struct logz_segment_writer *sw, const char *data, size_t size) {
+    if (Z_OK != deflateReset(&sw->zs))
+        return LOGGER_ERROR("%s", "deflateReset failed"), -1;
+    uLong bound = deflateBound(&sw->zs, size);
+    vmbuf_reset(&sw->zbuf);
+    vmbuf_resize_if_less(&sw->zbuf, bound);
+
+    sw->zs.next_in = (Bytef *)data;
+    sw->zs.avail_in = size;
+    sw->zs.next_out = (Bytef *)vmbuf_wloc(&sw->zbuf);
+    sw->zs.avail_out = bound;
+    if (Z_STREAM_END != deflate(&sw->zs, Z_FINISH))
+        return LOGGER_ERROR("deflate failed: %s", sw->zs.msg ? sw->zs.msg : "unknown"), -1;
+    vmbuf_wseek(&sw->zbuf, bound - sw->zs.avail_out);
+    return 0;
+}
+
+/*
+ * writes out buffered records. unless asked to drain everything, plain
+ * segments write up to the last block boundary of the file only: after a
+ * tick has flushed a partial tail, the next write fills that block up and
+ * blocks stay aligned. the remainder stays buffered for the next pass.
+ * on failure the segment is rolled back to its last good offset and the data
+ * stays buffered, so the next attempt rewrites it.
+ */
+static int
+segment_drain (struct logz_segment_writer *sw, bool all) {
+    size_t pending = vmbuf_wlocpos(&sw->block);
+    size_t size = pending;
+    if (!all && 0 == sw->compress_level) {
+        size_t end = ((size_t)sw->written + pending) & ~((size_t)LOGZ_SEGMENT_BLOCK_SIZE - 1);
+        size = end > (size_t)sw->written ? end - (size_t)sw->written : 0;
+    }
+    if (0 == size)
+        return 0;
+
+    const char *data = vmbuf_data(&sw->block);
+    size_t out_size = size;
+    if (0 < sw->compress_level) {
+        if (0 > segment_deflate(sw, data, size))
+            return -1;
+        data = vmbuf_data(&sw->zbuf);
+        out_size = vmbuf_wlocpos(&sw->zbuf);
+    }
+
+    if (0 > write_fully(sw->fd, data, out_size)) {
+        LOGGER_PERROR("segment write failed: %s", sw->tmp_name);
+        if (0 > ftruncate(sw->fd, sw->written) || 0 > lseek(sw->fd, sw->written, SEEK_SET))
+            LOGGER_PERROR("cannot roll back segment: %s", sw->tmp_name);
+        return -1;
+    }
+    sw->written += out_size;
+    vmbuf_reset(&sw->zbuf);
+
+    size_t rem = pending - size;
+    if (0 < rem)
+        memmove(vmbuf_data(&sw->block), vmbuf_data(&sw->block) + size, rem);
+    vmbuf_reset(&sw->block);
+    vmbuf_wseek(&sw->block, rem);
+    sw->pending_since = 0 < rem ? time(NULL) : 0;
+
+    // back to the working size once a stall's backlog is out
+    if (0 == rem && LOGZ_SEGMENT_BLOCK_SIZE * 2 < sw->block.capacity) {
+        vmbuf_free(&sw->block);
+        vmbuf_init(&sw->block, LOGZ_SEGMENT_BLOCK_SIZE * 2);
+    }
+    if (LOGZ_SEGMENT_BLOCK_SIZE * 2 < sw->zbuf.capacity) {
+        vmbuf_free(&sw->zbuf);
+        vmbuf_init(&sw->zbuf, LOGZ_SEGMENT_BLOCK_SIZE);
+    }
+    return 0;
+}
+
+static int
+segment_finish (struct logz_segment_writer *sw) {
+    if (0 > sw->fd)
+        return 0;
+    if (0 > segment_drain(sw, true))
+        return -1;
+
+    if (0 == sw->records) {
+        close(sw->fd);
+        sw->fd = -1;
+        unlink(sw->tmp_name);
+        return 0;
+    }
+
+    if (0 > fdatasync(sw->fd))
+        LOGGER_PERROR("fdatasync: %s", sw->tmp_name);
+    close(sw->fd);
+    sw->fd = -1;
+
+    // left in place otherwise, the next start publishes it
+    if (0 == access(sw->final_name, F_OK))
+        return LOGGER_ERROR("segment %s exists, leaving %s", sw->final_name, sw->tmp_name), -1;
+    if (0 > rename(sw->tmp_name, sw->final_name))
+        return LOGGER_PERROR("cannot publish segment %s, leaving %s", sw->final_name, sw->tmp_name), -1;
+    segment_index(sw, sw->final_name, sw->first_ts, sw->last_ts, sw->records, sw->raw_bytes);
+    return 0;
+}
+
+static bool
+segment_expired (struct logz_segment_writer *sw) {
+    return (0 < sw->max_size && sw->raw_bytes >= sw->max_size)
+        || (0 < sw->max_age && time(NULL) - sw->opened >= sw->max_age);
+}
+
+int
+logz_segment_writer_init (
+    struct logz_segment_writer *sw,
+    const char *target,
+    size_t max_size,
+    time_t max_age,
+    int compress_level) {
+
+    memset(sw, 0, sizeof(*sw));
+    sw->fd = -1;
+    sw->index_fd = -1;
+    sw->target = strdup(target);
+    sw->max_size = max_size;
+    sw->max_age = max_age;
+    sw->compress_level = compress_level;
+
+    char *dir = strdup(target), *base = strdup(target);
+    sw->dir = strdup(dirname(dir));
+    sw->base = strdup(basename(base));
+    free(dir);
+    free(base);
+
+    char index_name[PATH_MAX];
+    snprintf(index_name, sizeof(index_name), "%s.index", target);
+    sw->index_fd = open(index_name, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (0 > sw->index_fd)
+        return LOGGER_PERROR("cannot open segment index %s", index_name), -1;
+
+    if (0 < compress_level
+        && Z_OK != deflateInit2(&sw->zs, compress_level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY))
+        return LOGGER_ERROR("%s", "deflateInit2 failed"), -1;
+
+    vmbuf_init(&sw->block, LOGZ_SEGMENT_BLOCK_SIZE * 2);
+    if (0 < compress_level)
+        vmbuf_init(&sw->zbuf, LOGZ_SEGMENT_BLOCK_SIZE);
+    if (0 > segment_scan(sw))
+        return -1;
+    return segment_open(sw);
+}
+
+int
+logz_segment_writer_write (struct logz_segment_writer *sw, const char *data, size_t size) {
+    if (0 > sw->fd && 0 > segment_open(sw))
+        return -1;
+
+    if (LOGZ_SEGMENT_MAX_PENDING < vmbuf_wlocpos(&sw->block)) {
+        // disk keeps refusing us. don't hold on to more than this
+        size_t dropped = 0;
+        const char *p = vmbuf_data(&sw->block), *end = vmbuf_wloc(&sw->block);
+        while (NULL != (p = memchr(p, '\n', end - p))) {
+            ++dropped;
+            ++p;
+        }
+        LOGGER_ERROR("segment writer stalled, dropping %zu buffered records (%zu bytes)", dropped, vmbuf_wlocpos(&sw->block));
+        sw->records -= dropped < sw->records ? dropped : sw->records;
+        sw->raw_bytes -= vmbuf_wlocpos(&sw->block) < sw->raw_bytes ? vmbuf_wlocpos(&sw->block) : sw->raw_bytes;
+        vmbuf_reset(&sw->block);
+        vmbuf_reset(&sw->zbuf);
+    }
+
+    if (0 == vmbuf_wlocpos(&sw->block))
+        sw->pending_since = time(NULL);
+    uint64_t ts = now_ms();
+    if (0 == sw->records)
+        sw->first_ts = ts;
+    sw->last_ts = ts;
+    ++sw->records;
+    sw->raw_bytes += size + 1;
+
+    vmbuf_memcpy(&sw->block, data, size);
+    vmbuf_chrcpy(&sw->block, '\n');
+
+    if (segment_expired(sw))
+        return segment_finish(sw);
+    if (LOGZ_SEGMENT_BLOCK_SIZE <= vmbuf_wlocpos(&sw->block))
+        return segment_drain(sw, false);
+    return 0;
+}
+
+/*
+ * called when the daemon is idle: rotate aged segments, push out the tail
+ * otherwise. a compressed tail waits until it is worth a gzip member of its
+ * own, or has waited long enough
+ */
+int
+logz_segment_writer_tick (struct logz_segment_writer *sw) {
+    if (0 > sw->fd)
+        return 0;
+    if (segment_expired(sw))
+        return segment_finish(sw);
+    if (0 < sw->compress_level && LOGZ_SEGMENT_MIN_MEMBER > vmbuf_wlocpos(&sw->block)
+        && time(NULL) - sw->pending_since < LOGZ_SEGMENT_MEMBER_AGE)
+        return 0;
+    return segment_drain(sw, true);
+}
+
+int
+logz_segment_writer_close (struct logz_segment_writer *sw) {
+    int res = segment_finish(sw);
+    if (0 < sw->compress_level)
+        deflateEnd(&sw->zs);
+    if (0 <= sw->index_fd)
+        close(sw->index_fd);
+    sw->index_fd = -1;
+    vmbuf_free(&sw->block);
+    vmbuf_free(&sw->zbuf);
+    free(sw->target);
+    free(sw->dir);
+    free(sw->base);
+    sw->target = sw->dir = sw->base = NULL;
+    return res;
+}
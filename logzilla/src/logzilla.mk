@@ -1,6 +1,6 @@
 TARGET=logzilla
 
-SRC=logz.c
+SRC=logz.c logz_segment.c logz_filter.c
 
 CFLAGS+= -I ../../ribs2/include -I ../include -I .
 LDFLAGS+=-L -pthread -lz -ldl -L../../ribs2/lib -lribs2 -lrt